@@ -0,0 +1,197 @@
+//
+//  async_writer.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+}
+
+#include "async_writer.h"
+#include "log.h"
+#include "trace.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#define ASYNC_WRITER_BUFFER_SIZE (1 << 20)
+#define ASYNC_WRITER_BUFFER_ALIGNMENT 4096
+
+// Upper bound on buffers waiting for the disk.  Past this, the muxer blocks rather than growing memory without limit.
+#define ASYNC_WRITER_MAX_QUEUED 32
+
+AsyncFileWriter::AsyncFileWriter(const std::string filename) : _filename(filename), _position(0), _size(0), _closing(false) {
+    _fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (_fd == -1) {
+        LOG(LOG_ERROR, "couldn't open %s: %s", filename.c_str(), strerror(errno));
+        abort();
+    }
+
+    // NOTE: FFmpeg may reallocate or free the AVIOContext's buffer itself, so it must come from av_malloc().
+    // It's sized so that the muxer only calls write_packet() once per full buffer.
+    unsigned char *const avio_buffer = (unsigned char *)av_malloc(ASYNC_WRITER_BUFFER_SIZE);
+    assert(avio_buffer);
+
+    _io_ctx = avio_alloc_context(avio_buffer, ASYNC_WRITER_BUFFER_SIZE, 1, this, NULL, write_packet, seek);
+    assert(_io_ctx);
+
+    _thread = std::thread(&AsyncFileWriter::writer_main, this);
+}
+
+AVIOContext *AsyncFileWriter::io_context() const {
+    return _io_ctx;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+int AsyncFileWriter::write_packet(void *const opaque, const uint8_t *const buf, const int size) {
+#else /* LIBAVFORMAT_VERSION_MAJOR >= 61 */
+int AsyncFileWriter::write_packet(void *const opaque, uint8_t *const buf, const int size) {
+#endif /* LIBAVFORMAT_VERSION_MAJOR >= 61 */
+    AsyncFileWriter *const writer = (AsyncFileWriter *)opaque;
+    writer->enqueue(buf, size);
+    return size;
+}
+
+int64_t AsyncFileWriter::seek(void *const opaque, const int64_t offset, const int whence) {
+    AsyncFileWriter *const writer = (AsyncFileWriter *)opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return writer->_size;
+        case SEEK_SET:
+            writer->_position = offset;
+            break;
+        case SEEK_CUR:
+            writer->_position += offset;
+            break;
+        case SEEK_END:
+            writer->_position = writer->_size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+
+    return writer->_position;
+}
+
+void AsyncFileWriter::enqueue(const uint8_t *const buf, const size_t size) {
+    uint8_t *data = NULL;
+
+    {
+        TRACE_SPAN("async_writer_wait");
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait(lock, [this] { return _queue.size() < ASYNC_WRITER_MAX_QUEUED; });
+
+        if (size <= ASYNC_WRITER_BUFFER_SIZE && !_free_buffers.empty()) {
+            data = _free_buffers.back();
+            _free_buffers.pop_back();
+        }
+    }
+
+    if (data == NULL) {
+        const int rv = posix_memalign((void **)&data, ASYNC_WRITER_BUFFER_ALIGNMENT, std::max(size, (size_t)ASYNC_WRITER_BUFFER_SIZE));
+        assert(rv == 0);
+    }
+
+    memcpy(data, buf, size);
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back({ data, size, _position });
+    }
+
+    _condition.notify_all();
+
+    _position += size;
+    _size = std::max(_size, _position);
+}
+
+void AsyncFileWriter::writer_main() {
+    trace_set_thread_name("async writer");
+
+    for (;;) {
+        Chunk chunk;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [this] { return !_queue.empty() || _closing; });
+
+            if (_queue.empty()) {
+                return;
+            }
+
+            chunk = _queue.front();
+        }
+
+        TRACE_SPAN("pwrite");
+        size_t written = 0;
+        while (written < chunk.size) {
+            const ssize_t rv = pwrite(_fd, chunk.data + written, chunk.size - written, chunk.offset + written);
+
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            } else if (rv <= 0) {
+                LOG(LOG_ERROR, "write to %s failed: %s", _filename.c_str(), strerror(errno));
+                abort();
+            }
+
+            written += rv;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queue.pop_front();
+
+            if (chunk.size <= ASYNC_WRITER_BUFFER_SIZE) {
+                _free_buffers.push_back(chunk.data);
+            } else {
+                free(chunk.data);
+            }
+        }
+
+        _condition.notify_all();
+    }
+}
+
+void AsyncFileWriter::close() {
+    if (_io_ctx == NULL) {
+        return;
+    }
+
+    avio_flush(_io_ctx);
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closing = true;
+    }
+
+    _condition.notify_all();
+    _thread.join();
+
+    for (uint8_t *const buffer : _free_buffers) {
+        free(buffer);
+    }
+
+    _free_buffers.clear();
+
+    ::close(_fd);
+    _fd = -1;
+
+    av_freep(&_io_ctx->buffer);
+    avio_context_free(&_io_ctx);
+    assert(_io_ctx == NULL);
+}
+
+AsyncFileWriter::~AsyncFileWriter() {
+    // Abort if close() was never called.
+    assert(_io_ctx == NULL);
+}
@@ -0,0 +1,69 @@
+//
+//  async_writer.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "util.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+// An AVIOContext that batches muxer output into large aligned buffers and writes them to the file on a background thread, so the thread doing detection and encoding never waits on the disk.
+// Seeking is supported (it just moves the logical write position; each buffer is written with pwrite() at the offset it was produced at), so muxers can go back and patch headers.
+struct AsyncFileWriter : private DeleteImplicit {
+    AsyncFileWriter(std::string filename);
+    AVIOContext *io_context() const;
+
+    // Flushes, waits for everything queued to reach the file, and closes it.
+    void close();
+    ~AsyncFileWriter();
+
+private:
+    struct Chunk {
+        uint8_t *data;
+        size_t size;
+        int64_t offset;
+    };
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+    static int write_packet(void *opaque, const uint8_t *buf, int size);
+#else /* LIBAVFORMAT_VERSION_MAJOR >= 61 */
+    static int write_packet(void *opaque, uint8_t *buf, int size);
+#endif /* LIBAVFORMAT_VERSION_MAJOR >= 61 */
+    static int64_t seek(void *opaque, int64_t offset, int whence);
+
+    void enqueue(const uint8_t *buf, size_t size);
+    void writer_main();
+
+    std::string _filename;
+    int _fd;
+    AVIOContext *_io_ctx;
+
+    // Owned by the muxing thread.
+    int64_t _position;
+    int64_t _size;
+
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::deque<Chunk> _queue;
+    std::vector<uint8_t *> _free_buffers;
+    bool _closing;
+
+    std::thread _thread;
+};
+
+#endif /* ASYNC_WRITER_H */
@@ -0,0 +1,172 @@
+//
+//  audio_level.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+}
+
+#include "audio_level.h"
+#include "log.h"
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Four floats, operated on element-wise.  (GCC and Clang both support this spelling.)
+typedef float float4 __attribute__((vector_size(16)));
+typedef int32_t int4 __attribute__((vector_size(16)));
+
+// Samples are converted to float a block at a time, then measured with the vector kernel.
+#define AUDIO_BLOCK_SAMPLES 256
+
+struct LevelAccumulator {
+    float4 sum_of_squares;
+    float4 peak_square;
+};
+
+static void accumulate_block(LevelAccumulator &accumulator, const float *const samples, const size_t count) {
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        float4 x;
+        memcpy(&x, samples + i, sizeof (x));
+
+        const float4 square = x * x;
+        accumulator.sum_of_squares += square;
+
+        // Branch-free max: comparisons yield all-ones or all-zeros lanes.
+        const int4 greater = square > accumulator.peak_square;
+        accumulator.peak_square = (float4)(((int4)square & greater) | ((int4)accumulator.peak_square & ~greater));
+    }
+
+    // Leftovers go in lane 0.
+    for (; i < count; i++) {
+        const float square = samples[i] * samples[i];
+        accumulator.sum_of_squares[0] += square;
+
+        if (square > accumulator.peak_square[0]) {
+            accumulator.peak_square[0] = square;
+        }
+    }
+}
+
+template <typename Sample>
+static float sample_to_float(const Sample sample);
+
+template <> float sample_to_float<uint8_t>(const uint8_t sample) { return (sample - 128) * (1.0f / 128); }
+template <> float sample_to_float<int16_t>(const int16_t sample) { return sample * (1.0f / 32768); }
+template <> float sample_to_float<int32_t>(const int32_t sample) { return sample * (1.0f / 2147483648.0f); }
+template <> float sample_to_float<int64_t>(const int64_t sample) { return sample * (1.0f / 9223372036854775808.0f); }
+template <> float sample_to_float<float>(const float sample) { return sample; }
+template <> float sample_to_float<double>(const double sample) { return (float)sample; }
+
+template <typename Sample>
+static void accumulate_samples(LevelAccumulator &accumulator, const uint8_t *const data, const size_t count) {
+    const Sample *const samples = (const Sample *)data;
+    float block[AUDIO_BLOCK_SAMPLES];
+
+    for (size_t start = 0; start < count; start += AUDIO_BLOCK_SAMPLES) {
+        const size_t block_count = (count - start < AUDIO_BLOCK_SAMPLES) ? (count - start) : AUDIO_BLOCK_SAMPLES;
+
+        for (size_t i = 0; i < block_count; i++) {
+            block[i] = sample_to_float<Sample>(samples[start + i]);
+        }
+
+        accumulate_block(accumulator, block, block_count);
+    }
+}
+
+// Floats are measured in place, with no conversion pass.
+template <>
+void accumulate_samples<float>(LevelAccumulator &accumulator, const uint8_t *const data, const size_t count) {
+    accumulate_block(accumulator, (const float *)data, count);
+}
+
+AudioLevel measure_audio_level(const AVFrame *const frame) {
+    const enum AVSampleFormat format = (enum AVSampleFormat)frame->format;
+    const int channels = frame->channels;
+    const bool planar = av_sample_fmt_is_planar(format);
+
+    // Planar audio has one buffer per channel; packed audio has one buffer with the channels interleaved.  Either way, every sample counts the same.
+    const int buffer_count = planar ? channels : 1;
+    const size_t samples_per_buffer = planar ? frame->nb_samples : (size_t)frame->nb_samples * channels;
+
+    LevelAccumulator accumulator;
+    memset(&accumulator, 0, sizeof (accumulator));
+
+    for (int buffer = 0; buffer < buffer_count; buffer++) {
+        const uint8_t *const data = frame->extended_data[buffer];
+
+        switch (format) {
+            case AV_SAMPLE_FMT_U8:
+            case AV_SAMPLE_FMT_U8P:
+                accumulate_samples<uint8_t>(accumulator, data, samples_per_buffer);
+                break;
+            case AV_SAMPLE_FMT_S16:
+            case AV_SAMPLE_FMT_S16P:
+                accumulate_samples<int16_t>(accumulator, data, samples_per_buffer);
+                break;
+            case AV_SAMPLE_FMT_S32:
+            case AV_SAMPLE_FMT_S32P:
+                accumulate_samples<int32_t>(accumulator, data, samples_per_buffer);
+                break;
+            case AV_SAMPLE_FMT_S64:
+            case AV_SAMPLE_FMT_S64P:
+                accumulate_samples<int64_t>(accumulator, data, samples_per_buffer);
+                break;
+            case AV_SAMPLE_FMT_FLT:
+            case AV_SAMPLE_FMT_FLTP:
+                accumulate_samples<float>(accumulator, data, samples_per_buffer);
+                break;
+            case AV_SAMPLE_FMT_DBL:
+            case AV_SAMPLE_FMT_DBLP:
+                accumulate_samples<double>(accumulator, data, samples_per_buffer);
+                break;
+            default:
+                LOG(LOG_ERROR, "unsupported sample format: %d", format);
+                abort();
+        }
+    }
+
+    const size_t total_samples = (size_t)frame->nb_samples * channels;
+    const float4 sums = accumulator.sum_of_squares;
+    const float4 peaks = accumulator.peak_square;
+    const float sum_of_squares = sums[0] + sums[1] + sums[2] + sums[3];
+    const float peak_square = fmaxf(fmaxf(peaks[0], peaks[1]), fmaxf(peaks[2], peaks[3]));
+
+    AudioLevel level;
+    level.rms = total_samples ? sqrtf(sum_of_squares / total_samples) : 0;
+    level.peak = sqrtf(peak_square);
+    return level;
+}
+
+// ---
+
+AudioTrigger::AudioTrigger(const float rms_threshold_dbfs, const unsigned int vote_count, const unsigned int vote_window) : _window(vote_window) {
+    set_parameters(rms_threshold_dbfs, vote_count, vote_window);
+}
+
+void AudioTrigger::set_parameters(const float rms_threshold_dbfs, const unsigned int vote_count, const unsigned int vote_window) {
+    // Compare linear levels rather than taking a log per frame.
+    _rms_threshold = powf(10, rms_threshold_dbfs / 20);
+    _vote_count = vote_count;
+
+    if (vote_window != _window.length()) {
+        _window.set_length(vote_window);
+    }
+}
+
+bool AudioTrigger::process(const AVFrame *const frame, AudioLevel *const level_out) {
+    const AudioLevel level = measure_audio_level(frame);
+    if (level_out) *level_out = level;
+
+    _window.append(level.rms >= _rms_threshold);
+    return _window.count_true() >= _vote_count;
+}
@@ -0,0 +1,46 @@
+//
+//  audio_level.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "util.h"
+#include <math.h>
+#include <stdint.h>
+
+#ifndef AUDIO_LEVEL_H
+#define AUDIO_LEVEL_H
+
+#define MAX_AUDIO_VOTE_WINDOW 120
+
+// Levels relative to full scale (0 to 1), across all channels.
+struct AudioLevel {
+    float rms;
+    float peak;
+};
+
+// Works on any planar or packed sample format.
+AudioLevel measure_audio_level(const AVFrame *frame);
+
+static inline float level_to_dbfs(const float level) {
+    return (level > 0) ? 20 * log10f(level) : -INFINITY;
+}
+
+// Triggers recording when vote_count of the last vote_window audio frames are at least rms_threshold_dbfs loud.
+struct AudioTrigger : private DeleteImplicit {
+    AudioTrigger(float rms_threshold_dbfs, unsigned int vote_count, unsigned int vote_window);
+    void set_parameters(float rms_threshold_dbfs, unsigned int vote_count, unsigned int vote_window);
+    bool process(const AVFrame *frame, AudioLevel *level_out);
+
+private:
+    float _rms_threshold;
+    unsigned int _vote_count;
+    SlidingWindowCount<MAX_AUDIO_VOTE_WINDOW> _window;
+};
+
+#endif /* AUDIO_LEVEL_H */
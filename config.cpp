@@ -0,0 +1,227 @@
+//
+//  config.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+#include "config.h"
+#include "audio_level.h"
+#include "output.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+
+static std::string trim(const std::string s) {
+    const size_t first = s.find_first_not_of(" \t\r");
+
+    if (first == std::string::npos) {
+        return "";
+    }
+
+    const size_t last = s.find_last_not_of(" \t\r");
+    return s.substr(first, last - first + 1);
+}
+
+static bool parse_long(const std::string value, const long min, const long max, long *const out) {
+    errno = 0;
+    char *end;
+    const long n = strtol(value.c_str(), &end, 10);
+
+    if (errno != 0 || end == value.c_str() || *end != '\0' || n < min || n > max) {
+        return false;
+    }
+
+    *out = n;
+    return true;
+}
+
+template <typename T>
+static bool parse_integer(const std::string value, const long min, const long max, T *const out) {
+    long n;
+
+    if (!parse_long(value, min, max, &n)) {
+        return false;
+    }
+
+    *out = (T)n;
+    return true;
+}
+
+static bool parse_float(const std::string value, float *const out) {
+    errno = 0;
+    char *end;
+    const float f = strtof(value.c_str(), &end);
+
+    if (errno != 0 || end == value.c_str() || *end != '\0') {
+        return false;
+    }
+
+    *out = f;
+    return true;
+}
+
+static bool parse_log_level(const std::string value, LogLevel *const out) {
+    static const char *const names[] = { "error", "warning", "info", "debug" };
+
+    for (int i = 0; i < 4; i++) {
+        if (value == names[i]) {
+            *out = (LogLevel)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool parse_bool(const std::string value, bool *const out) {
+    if (value == "1" || value == "yes" || value == "true" || value == "on") {
+        *out = true;
+    } else if (value == "0" || value == "no" || value == "false" || value == "off") {
+        *out = false;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Returns false if the key is unknown or the value doesn't parse or is out of range.
+static bool set_config_value(Config &config, const std::string key, const std::string value) {
+    DetectorParameters &detector = config.detector;
+
+    if (key == "strike_zone_min_x") return parse_integer(value, 0, INT_MAX, &detector.strike_zone_min_x);
+    if (key == "strike_zone_max_x") return parse_integer(value, 0, INT_MAX, &detector.strike_zone_max_x);
+    if (key == "strike_zone_min_y") return parse_integer(value, 0, INT_MAX, &detector.strike_zone_min_y);
+    if (key == "strike_zone_max_y") return parse_integer(value, 0, INT_MAX, &detector.strike_zone_max_y);
+    if (key == "pixel_difference_threshold") return parse_integer(value, 0, UINT8_MAX, &detector.pixel_difference_threshold);
+    if (key == "different_pixels_count_threshold") return parse_integer(value, 0, INT_MAX, &detector.different_pixels_count_threshold);
+    if (key == "block_changed_pixels_threshold") return parse_integer(value, 0, UINT16_MAX, &detector.block_changed_pixels_threshold);
+    if (key == "min_region_pixels") return parse_integer(value, 0, INT_MAX, &detector.min_region_pixels);
+    if (key == "vote_count") return parse_integer(value, 1, MAX_VOTE_WINDOW, &detector.vote_count);
+    if (key == "vote_window") return parse_integer(value, 1, MAX_VOTE_WINDOW, &detector.vote_window);
+
+    if (key == "after_motion_record_seconds") return parse_integer(value, 0, INT_MAX, &config.after_motion_record_seconds);
+    if (key == "pre_roll_frames") return parse_integer(value, 0, MAX_PRE_ROLL_FRAMES, &config.pre_roll_frames);
+    if (key == "log_level") return parse_log_level(value, &config.log_level);
+
+    if (key == "audio_trigger_enabled") return parse_bool(value, &config.audio_trigger_enabled);
+    if (key == "audio_trigger_rms_dbfs") return parse_float(value, &config.audio_trigger_rms_dbfs);
+    if (key == "audio_trigger_vote_count") return parse_integer(value, 1, MAX_AUDIO_VOTE_WINDOW, &config.audio_trigger_vote_count);
+    if (key == "audio_trigger_vote_window") return parse_integer(value, 1, MAX_AUDIO_VOTE_WINDOW, &config.audio_trigger_vote_window);
+
+    if (key == "encoder_fastest_preset") return is_encoder_preset(config.encoder_fastest_preset = value);
+    if (key == "encoder_slowest_preset") return is_encoder_preset(config.encoder_slowest_preset = value);
+    if (key == "encoder_min_crf") return parse_integer(value, 0, 51, &config.encoder_min_crf);
+    if (key == "encoder_max_crf") return parse_integer(value, 0, 51, &config.encoder_max_crf);
+    if (key == "fragmented_output") return parse_bool(value, &config.fragmented_output);
+    if (key == "grid_snapshot_enabled") return parse_bool(value, &config.grid_snapshot_enabled);
+
+    if (key == "continuous_recording") return parse_bool(value, &config.continuous_recording);
+    if (key == "live_view_enabled") return parse_bool(value, &config.live_view_enabled);
+    if (key == "live_view_socket_path") return !(config.live_view_socket_path = value).empty();
+    if (key == "live_view_format") return (config.live_view_format = value) == "mpegts" || value == "mp4";
+    if (key == "frame_export_enabled") return parse_bool(value, &config.frame_export_enabled);
+    if (key == "frame_export_socket_path") return !(config.frame_export_socket_path = value).empty();
+    if (key == "frame_export_slot_count") return parse_integer(value, 1, 1024, &config.frame_export_slot_count);
+    if (key == "frame_export_full_yuv") return parse_bool(value, &config.frame_export_full_yuv);
+
+    return false;
+}
+
+bool load_config(const std::string filename, Config &config) {
+    std::ifstream file(filename);
+
+    if (!file) {
+        LOG(LOG_ERROR, "couldn't open config file %s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Parse into a copy, so that a bad file changes nothing.
+    Config new_config = config;
+    std::string line;
+    int line_number = 0;
+
+    while (std::getline(file, line)) {
+        line_number++;
+
+        const size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+
+        line = trim(line);
+        if (line.empty()) {
+            continue;
+        }
+
+        const size_t equals = line.find('=');
+        if (equals == std::string::npos) {
+            LOG(LOG_ERROR, "%s:%d: expected `key = value`", filename.c_str(), line_number);
+            return false;
+        }
+
+        const std::string key = trim(line.substr(0, equals));
+        const std::string value = trim(line.substr(equals + 1));
+
+        if (!set_config_value(new_config, key, value)) {
+            LOG(LOG_ERROR, "%s:%d: bad setting `%s = %s`", filename.c_str(), line_number, key.c_str(), value.c_str());
+            return false;
+        }
+    }
+
+    // Check the settings that only make sense together.
+    const DetectorParameters &detector = new_config.detector;
+
+    if (detector.strike_zone_min_x > detector.strike_zone_max_x || detector.strike_zone_min_y > detector.strike_zone_max_y) {
+        LOG(LOG_ERROR, "%s: strike zone is empty", filename.c_str());
+        return false;
+    }
+
+    // Otherwise the voter could never trigger.
+    if (detector.vote_count > detector.vote_window) {
+        LOG(LOG_ERROR, "%s: vote_count exceeds vote_window", filename.c_str());
+        return false;
+    }
+
+    if (new_config.audio_trigger_vote_count > new_config.audio_trigger_vote_window) {
+        LOG(LOG_ERROR, "%s: audio_trigger_vote_count exceeds audio_trigger_vote_window", filename.c_str());
+        return false;
+    }
+
+    if (new_config.encoder_min_crf > new_config.encoder_max_crf || !encoder_presets_ordered(new_config.encoder_fastest_preset, new_config.encoder_slowest_preset)) {
+        LOG(LOG_ERROR, "%s: encoder bounds are inverted", filename.c_str());
+        return false;
+    }
+
+    config = new_config;
+    return true;
+}
+
+void keep_startup_only_settings(const Config &old_config, Config &new_config) {
+    const bool changed =
+        old_config.continuous_recording != new_config.continuous_recording ||
+        old_config.live_view_enabled != new_config.live_view_enabled ||
+        old_config.live_view_socket_path != new_config.live_view_socket_path ||
+        old_config.live_view_format != new_config.live_view_format ||
+        old_config.frame_export_enabled != new_config.frame_export_enabled ||
+        old_config.frame_export_socket_path != new_config.frame_export_socket_path ||
+        old_config.frame_export_slot_count != new_config.frame_export_slot_count ||
+        old_config.frame_export_full_yuv != new_config.frame_export_full_yuv;
+
+    if (changed) {
+        LOG(LOG_WARNING, "config: continuous recording, live view and frame export settings take effect on restart");
+    }
+
+    new_config.continuous_recording = old_config.continuous_recording;
+    new_config.live_view_enabled = old_config.live_view_enabled;
+    new_config.live_view_socket_path = old_config.live_view_socket_path;
+    new_config.live_view_format = old_config.live_view_format;
+    new_config.frame_export_enabled = old_config.frame_export_enabled;
+    new_config.frame_export_socket_path = old_config.frame_export_socket_path;
+    new_config.frame_export_slot_count = old_config.frame_export_slot_count;
+    new_config.frame_export_full_yuv = old_config.frame_export_full_yuv;
+}
@@ -0,0 +1,55 @@
+//
+//  config.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+#include "detector.h"
+#include "log.h"
+#include <string>
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// Upper bound on the configurable pre-roll, in frames (video and audio).  This sizes frame_buffer.
+#define MAX_PRE_ROLL_FRAMES 4000
+
+// Everything tunable without rebuilding.  sophie.cpp supplies the defaults; a config file (see sophie.conf.example) overrides any subset of them.
+struct Config {
+    DetectorParameters detector;
+    unsigned int after_motion_record_seconds;
+    unsigned int pre_roll_frames;
+    LogLevel log_level;
+
+    bool audio_trigger_enabled;
+    float audio_trigger_rms_dbfs;
+    unsigned int audio_trigger_vote_count;
+    unsigned int audio_trigger_vote_window;
+
+    std::string encoder_fastest_preset;
+    std::string encoder_slowest_preset;
+    int encoder_min_crf;
+    int encoder_max_crf;
+    bool fragmented_output;
+    bool grid_snapshot_enabled;
+
+    // The rest only take effect at startup: they decide what gets set up around the input.
+    bool continuous_recording;
+    bool live_view_enabled;
+    std::string live_view_socket_path;
+    std::string live_view_format;
+    bool frame_export_enabled;
+    std::string frame_export_socket_path;
+    unsigned int frame_export_slot_count;
+    bool frame_export_full_yuv;
+};
+
+// Reads `key = value` lines (with `#` comments) from filename over the values already in config.
+// On any error, reports it and returns false, leaving config untouched.
+bool load_config(std::string filename, Config &config);
+
+// For a reload: carries over the settings that can't change without restarting, and reports any the file tried to change.
+void keep_startup_only_settings(const Config &old_config, Config &new_config);
+
+#endif /* CONFIG_H */
@@ -0,0 +1,173 @@
+//
+//  detector.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "detector.h"
+#include "trace.h"
+#include "yuv.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+DetectorChain::DetectorChain(const DetectorParameters &parameters) : _parameters(parameters) { }
+
+const DetectorParameters &DetectorChain::parameters() const {
+    return _parameters;
+}
+
+void DetectorChain::set_parameters(const DetectorParameters &parameters) {
+    _parameters = parameters;
+
+    for (const std::unique_ptr<TemporalVoter> &voter : _voters) {
+        voter->set_parameters(_parameters);
+    }
+}
+
+void DetectorChain::add_scorer(std::unique_ptr<FrameScorer> scorer) {
+    _scorers.push_back(std::move(scorer));
+}
+
+void DetectorChain::add_threshold(std::unique_ptr<FrameThreshold> threshold) {
+    _thresholds.push_back(std::move(threshold));
+}
+
+void DetectorChain::add_voter(std::unique_ptr<TemporalVoter> voter) {
+    voter->set_parameters(_parameters);
+    _voters.push_back(std::move(voter));
+}
+
+DetectorResult DetectorChain::process(const AVFrame *const previous, const AVFrame *const frame, FrameScore &score) {
+    TRACE_SPAN("detect");
+    memset(&score, 0, sizeof (score));
+
+    for (const std::unique_ptr<FrameScorer> &scorer : _scorers) {
+        scorer->score(previous, frame, _parameters, score);
+    }
+
+    DetectorResult result;
+    result.frame_interesting = true;
+
+    for (const std::unique_ptr<FrameThreshold> &threshold : _thresholds) {
+        if (!threshold->passes(score, _parameters)) {
+            result.frame_interesting = false;
+            break;
+        }
+    }
+
+    // Every voter sees every frame (so its window stays current), even once one has said no.
+    result.triggered = !_voters.empty();
+
+    for (const std::unique_ptr<TemporalVoter> &voter : _voters) {
+        if (!voter->vote(result.frame_interesting, score)) {
+            result.triggered = false;
+        }
+    }
+
+    return result;
+}
+
+// ---
+
+// Only the luma plane is compared, in place; differences are scaled to 8 bits so the thresholds are format-independent.
+// TODO: vector-optimize
+template <typename Format>
+static uint32_t frame_difference_luma(const AVFrame *const frame1, const AVFrame *const frame2, const DetectorParameters &parameters, Histogram<10> &histogram, MotionGrid &grid, uint8_t *const difference_buffer) {
+    typedef typename Format::Sample Sample;
+    const int width = frame1->width;
+    const int height = frame1->height;
+    const int min_x = std::max(parameters.strike_zone_min_x, 0);
+    const int min_y = std::max(parameters.strike_zone_min_y, 0);
+    const int max_x = std::min(parameters.strike_zone_max_x, width);
+    const int max_y = std::min(parameters.strike_zone_max_y, height);
+    const uint8_t threshold = parameters.pixel_difference_threshold;
+    uint32_t pixels_different = 0;
+
+    for (int y = min_y; y < max_y; y++) {
+        const Sample *const row1 = Format::row(frame1, 0, y);
+        const Sample *const row2 = Format::row(frame2, 0, y);
+        uint8_t *const diffrow = difference_buffer ? (difference_buffer + y * width) : NULL;
+
+        for (int x = min_x; x < max_x; x++) {
+            const uint8_t pixel1 = Format::to_8bit(row1[x]);
+            const uint8_t pixel2 = Format::to_8bit(row2[x]);
+            uint8_t *const diffpixel = diffrow ? (diffrow + x) : NULL;
+
+            const uint8_t difference = (pixel1 > pixel2) ? (pixel1 - pixel2) : (pixel2 - pixel1);
+            histogram.increment(difference);
+
+            if (difference >= threshold) {
+                grid.increment(x, y);
+                pixels_different++;
+            }
+
+            if (diffpixel) {
+                *diffpixel = difference;
+            }
+        }
+    }
+
+    return pixels_different;
+}
+
+LumaDifferenceScorer::LumaDifferenceScorer() : _difference_buffer(NULL), _difference_buffer_size(0) { }
+
+void LumaDifferenceScorer::score(const AVFrame *const previous, const AVFrame *const frame, const DetectorParameters &parameters, FrameScore &score) {
+    assert(previous->format == frame->format);
+    assert(previous->width  == frame->width);
+    assert(previous->height == frame->height);
+
+    const size_t size = frame->width * frame->height * sizeof (uint8_t);
+    if (_difference_buffer_size != size) {
+        free(_difference_buffer);
+        _difference_buffer = (uint8_t *)calloc(size, 1);
+        _difference_buffer_size = size;
+    }
+
+    _histogram.reset();
+    _grid.reset(frame->width, frame->height);
+
+    score.pixels_different = dispatch_yuv420(frame->format, [&](const auto format) {
+        return frame_difference_luma<decltype(format)>(previous, frame, parameters, _histogram, _grid, _difference_buffer);
+    });
+
+    score.region = _grid.largest_region(parameters.block_changed_pixels_threshold);
+    score.histogram = &_histogram;
+    score.grid = &_grid;
+    score.difference_buffer = _difference_buffer;
+}
+
+LumaDifferenceScorer::~LumaDifferenceScorer() {
+    free(_difference_buffer);
+}
+
+bool PixelCountThreshold::passes(const FrameScore &score, const DetectorParameters &parameters) const {
+    return score.pixels_different >= parameters.different_pixels_count_threshold;
+}
+
+bool RegionThreshold::passes(const FrameScore &score, const DetectorParameters &parameters) const {
+    return score.region.pixels >= parameters.min_region_pixels;
+}
+
+KOfNVoter::KOfNVoter(const DetectorParameters &parameters) : _window(parameters.vote_window), _vote_count(parameters.vote_count) { }
+
+void KOfNVoter::set_parameters(const DetectorParameters &parameters) {
+    if (parameters.vote_window != _window.length()) {
+        _window.set_length(parameters.vote_window);
+    }
+
+    _vote_count = parameters.vote_count;
+}
+
+bool KOfNVoter::vote(const bool frame_interesting, FrameScore &score) {
+    _window.append(frame_interesting);
+    score.recent_interesting_frames = std::max(score.recent_interesting_frames, _window.count_true());
+    return _window.count_true() >= _vote_count;
+}
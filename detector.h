@@ -0,0 +1,134 @@
+//
+//  detector.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "util.h"
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#define MOTION_BLOCK_SIZE 16
+#define MAX_VOTE_WINDOW 120
+
+typedef BlockGrid<MOTION_BLOCK_SIZE> MotionGrid;
+
+// Everything tunable about detection.  May be changed between frames with DetectorChain::set_parameters().
+struct DetectorParameters {
+    // Region of the frame considered at all.
+    int strike_zone_min_x;
+    int strike_zone_max_x;
+    int strike_zone_min_y;
+    int strike_zone_max_y;
+
+    // Filter 1: pixels are only counted as different if they change by this much, to discard sensor noise.
+    uint8_t pixel_difference_threshold;
+
+    // Filter 2: frames are only counted as interesting if this many pixels are different, to discard small differences like leaves in the wind and birds...
+    uint32_t different_pixels_count_threshold;
+
+    // ...and if this many of them are in one connected region of blocks (each with at least block_changed_pixels_threshold changed pixels), so that noise scattered across the frame doesn't add up to an object.
+    uint16_t block_changed_pixels_threshold;
+    uint32_t min_region_pixels;
+
+    // Filter 3: recording is only triggered if vote_count out of the last vote_window frames are interesting, to discard transient dazzle.
+    unsigned int vote_count;
+    unsigned int vote_window;
+};
+
+// What the scorers measured about one video frame.  Pointers are owned by the scorer that filled them in and valid until the next frame.
+struct FrameScore {
+    uint32_t pixels_different;
+    MotionGrid::Region region;
+    const Histogram<10> *histogram;
+    const MotionGrid *grid;
+    const uint8_t *difference_buffer;
+
+    // Filled in by voters: how many recent frames were interesting.
+    uint32_t recent_interesting_frames;
+};
+
+// Stage 1: measures a frame (against the previous one) and fills in its part of the FrameScore.
+struct FrameScorer {
+    virtual void score(const AVFrame *previous, const AVFrame *frame, const DetectorParameters &parameters, FrameScore &score) = 0;
+    virtual ~FrameScorer() = default;
+};
+
+// Stage 2: decides from the score whether a single frame is interesting.  A frame must pass every threshold.
+struct FrameThreshold {
+    virtual bool passes(const FrameScore &score, const DetectorParameters &parameters) const = 0;
+    virtual ~FrameThreshold() = default;
+};
+
+// Stage 3: decides over time whether to trigger, given whether each frame was interesting.  Every voter must agree.
+struct TemporalVoter {
+    virtual void set_parameters(const DetectorParameters &parameters) {}
+    virtual bool vote(bool frame_interesting, FrameScore &score) = 0;
+    virtual ~TemporalVoter() = default;
+};
+
+struct DetectorResult {
+    bool frame_interesting;
+    bool triggered;
+};
+
+struct DetectorChain : private DeleteImplicit {
+    DetectorChain(const DetectorParameters &parameters);
+    const DetectorParameters &parameters() const;
+    void set_parameters(const DetectorParameters &parameters);
+
+    void add_scorer(std::unique_ptr<FrameScorer> scorer);
+    void add_threshold(std::unique_ptr<FrameThreshold> threshold);
+    void add_voter(std::unique_ptr<TemporalVoter> voter);
+
+    DetectorResult process(const AVFrame *previous, const AVFrame *frame, FrameScore &score);
+
+private:
+    DetectorParameters _parameters;
+    std::vector<std::unique_ptr<FrameScorer>> _scorers;
+    std::vector<std::unique_ptr<FrameThreshold>> _thresholds;
+    std::vector<std::unique_ptr<TemporalVoter>> _voters;
+};
+
+// The luma difference against the previous frame: histogram, count of changed pixels, and block grid with its largest region.
+struct LumaDifferenceScorer : public FrameScorer, private DeleteImplicit {
+    LumaDifferenceScorer();
+    void score(const AVFrame *previous, const AVFrame *frame, const DetectorParameters &parameters, FrameScore &score) override;
+    ~LumaDifferenceScorer();
+
+private:
+    Histogram<10> _histogram;
+    MotionGrid _grid;
+    uint8_t *_difference_buffer;
+    size_t _difference_buffer_size;
+};
+
+struct PixelCountThreshold : public FrameThreshold {
+    bool passes(const FrameScore &score, const DetectorParameters &parameters) const override;
+};
+
+struct RegionThreshold : public FrameThreshold {
+    bool passes(const FrameScore &score, const DetectorParameters &parameters) const override;
+};
+
+// Triggers when at least vote_count of the last vote_window frames were interesting.
+struct KOfNVoter : public TemporalVoter, private DeleteImplicit {
+    KOfNVoter(const DetectorParameters &parameters);
+    void set_parameters(const DetectorParameters &parameters) override;
+    bool vote(bool frame_interesting, FrameScore &score) override;
+
+private:
+    SlidingWindowCount<MAX_VOTE_WINDOW> _window;
+    unsigned int _vote_count;
+};
+
+#endif /* DETECTOR_H */
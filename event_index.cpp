@@ -0,0 +1,177 @@
+//
+//  event_index.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+#include "event_index.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <filesystem>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Grow the file this many records at a time, so most appends are just a store into the mapping.
+#define EVENT_INDEX_GROWTH 256
+
+static size_t mapped_size_for_capacity(const uint64_t capacity) {
+    return sizeof (EventIndexHeader) + capacity * sizeof (EventRecord);
+}
+
+EventIndex::EventIndex(const std::string directory) : _directory(directory), _fd(-1), _header(NULL), _mapped_size(0) { }
+
+void EventIndex::open(const std::string &datestamp) {
+    assert(_fd == -1);
+
+    const std::string date_directory = _directory + "/" + datestamp;
+    std::filesystem::create_directory(date_directory);
+
+    const std::string filename = date_directory + "/" + EVENT_INDEX_FILENAME;
+    _fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    assert(_fd != -1);
+
+    struct stat st;
+    int rv = fstat(_fd, &st);
+    assert(rv == 0);
+
+    if ((size_t)st.st_size < sizeof (EventIndexHeader)) {
+        // New (or truncated) index.
+        _mapped_size = mapped_size_for_capacity(EVENT_INDEX_GROWTH);
+        rv = ftruncate(_fd, _mapped_size);
+        assert(rv == 0);
+    } else {
+        _mapped_size = st.st_size;
+    }
+
+    _header = (EventIndexHeader *)mmap(NULL, _mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    assert(_header != MAP_FAILED);
+
+    if (memcmp(_header->magic, EVENT_INDEX_MAGIC, sizeof (_header->magic)) != 0) {
+        memcpy(_header->magic, EVENT_INDEX_MAGIC, sizeof (_header->magic));
+        _header->version = EVENT_INDEX_VERSION;
+        _header->record_size = sizeof (EventRecord);
+        _header->count = 0;
+    }
+
+    assert(_header->version == EVENT_INDEX_VERSION);
+    assert(_header->record_size == sizeof (EventRecord));
+
+    _datestamp = datestamp;
+}
+
+void EventIndex::close() {
+    if (_fd == -1) {
+        return;
+    }
+
+    munmap(_header, _mapped_size);
+    ::close(_fd);
+    _header = NULL;
+    _mapped_size = 0;
+    _fd = -1;
+    _datestamp.clear();
+}
+
+void EventIndex::append(const EventRecord &record) {
+    const std::string datestamp = datestamp_string(record.wallclock);
+
+    if (datestamp != _datestamp) {
+        close();
+        open(datestamp);
+    }
+
+    const uint64_t count = _header->count;
+
+    if (mapped_size_for_capacity(count + 1) > _mapped_size) {
+        const size_t new_size = mapped_size_for_capacity(count + EVENT_INDEX_GROWTH);
+        munmap(_header, _mapped_size);
+
+        const int rv = ftruncate(_fd, new_size);
+        assert(rv == 0);
+
+        _header = (EventIndexHeader *)mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        assert(_header != MAP_FAILED);
+        _mapped_size = new_size;
+    }
+
+    EventRecord *const records = (EventRecord *)(_header + 1);
+    records[count] = record;
+
+    // Publish the record only after it's completely written, so a concurrent reader never sees a torn one.
+    __atomic_store_n(&_header->count, count + 1, __ATOMIC_RELEASE);
+}
+
+EventIndex::~EventIndex() {
+    close();
+}
+
+// ---
+
+EventIndexReader::EventIndexReader(const std::string filename) : _header(NULL), _mapped_size(0) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+
+    if (fd == -1) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof (EventIndexHeader)) {
+        void *const map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (map != MAP_FAILED) {
+            _header = (const EventIndexHeader *)map;
+            _mapped_size = st.st_size;
+        }
+    }
+
+    ::close(fd);
+
+    if (_header != NULL && (memcmp(_header->magic, EVENT_INDEX_MAGIC, sizeof (_header->magic)) != 0 || _header->version != EVENT_INDEX_VERSION || _header->record_size != sizeof (EventRecord))) {
+        munmap((void *)_header, _mapped_size);
+        _header = NULL;
+        _mapped_size = 0;
+    }
+}
+
+bool EventIndexReader::is_valid() const {
+    return _header != NULL;
+}
+
+size_t EventIndexReader::count() const {
+    if (_header == NULL) {
+        return 0;
+    }
+
+    // The writer may have grown the file since we mapped it; only trust records that fit in our mapping.
+    const uint64_t count = __atomic_load_n(&_header->count, __ATOMIC_ACQUIRE);
+    const uint64_t capacity = (_mapped_size - sizeof (EventIndexHeader)) / sizeof (EventRecord);
+    return std::min(count, capacity);
+}
+
+const EventRecord *EventIndexReader::records() const {
+    return _header ? (const EventRecord *)(_header + 1) : NULL;
+}
+
+size_t EventIndexReader::lower_bound(const int64_t wallclock) const {
+    if (_header == NULL) {
+        return 0;
+    }
+
+    const EventRecord *const begin = records();
+    const EventRecord *const end = begin + count();
+
+    return std::lower_bound(begin, end, wallclock, [](const EventRecord &record, const int64_t wallclock) {
+        return record.wallclock < wallclock;
+    }) - begin;
+}
+
+EventIndexReader::~EventIndexReader() {
+    if (_header != NULL) {
+        munmap((void *)_header, _mapped_size);
+    }
+}
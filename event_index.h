@@ -0,0 +1,74 @@
+//
+//  event_index.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+#include "util.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#ifndef EVENT_INDEX_H
+#define EVENT_INDEX_H
+
+#define EVENT_INDEX_FILENAME "events.idx"
+#define EVENT_INDEX_MAGIC "SOPHIDX"
+#define EVENT_INDEX_VERSION 1
+
+// On-disk layout.  Records are fixed-size and appended in wallclock order, so a day's index can be binary-searched straight out of the mapping.
+// Paths are relative to the output directory.
+struct EventRecord {
+    int64_t wallclock;           // time_t at the start of the event
+    int64_t start_pts;           // in time_base
+    int64_t end_pts;             // in time_base
+    int32_t time_base_num;
+    int32_t time_base_den;
+    uint32_t peak_pixels_different;
+    uint32_t interesting_frame_count;
+    char video_path[240];
+    char image_path[240];
+};
+
+struct EventIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;              // only incremented once the record is completely written
+};
+
+// Appends to <directory>/YYYY-MM-DD/events.idx, picking the day from each record's wallclock.
+struct EventIndex : private DeleteImplicit {
+    EventIndex(std::string directory);
+    void append(const EventRecord &record);
+    ~EventIndex();
+
+private:
+    void open(const std::string &datestamp);
+    void close();
+
+    std::string _directory;
+    std::string _datestamp;
+    int _fd;
+    EventIndexHeader *_header;
+    size_t _mapped_size;
+};
+
+// Read-only view of one day's index.
+struct EventIndexReader : private DeleteImplicit {
+    EventIndexReader(std::string filename);
+    bool is_valid() const;
+    size_t count() const;
+    const EventRecord *records() const;
+
+    // Index of the first record starting at or after the given time.
+    size_t lower_bound(int64_t wallclock) const;
+    ~EventIndexReader();
+
+private:
+    const EventIndexHeader *_header;
+    size_t _mapped_size;
+};
+
+#endif /* EVENT_INDEX_H */
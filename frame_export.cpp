@@ -0,0 +1,281 @@
+//
+//  frame_export.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "frame_export.h"
+#include "log.h"
+#include "yuv.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && !defined(F_SEAL_FUTURE_WRITE)
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif /* defined(__linux__) && !defined(F_SEAL_FUTURE_WRITE) */
+
+// Creates an anonymous shared-memory object of the given size and maps it read-write.
+// Also returns the object's fd and an fd to hand to readers, which can't be used to write to the object.  Returns MAP_FAILED on failure.
+static uint8_t *create_shared_memory(const size_t size, int *const fd_out, int *const reader_fd_out) {
+#if defined(__linux__)
+    const int fd = memfd_create("sophie-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        return (uint8_t *)MAP_FAILED;
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return (uint8_t *)MAP_FAILED;
+    }
+
+    uint8_t *const map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return map;
+    }
+
+    // Once our mapping exists, seal the object: no new writable mappings or writes (Linux 5.1), and no resizing under readers' mappings.
+    // Seals belong to the object, so they hold however a reader reopens its fd.
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE) != 0) {
+        LOG(LOG_WARNING, "frame export: couldn't seal shared memory: %s", strerror(errno));
+        munmap(map, size);
+        close(fd);
+        return (uint8_t *)MAP_FAILED;
+    }
+
+    const int reader_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#else /* defined(__linux__) */
+    // No sealing: use a named POSIX shared-memory object, but only long enough to open it twice.  Readers get the O_RDONLY description.
+    const std::string name = "/sophie-frames." + std::to_string(getpid());
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return (uint8_t *)MAP_FAILED;
+    }
+
+    const int reader_fd = shm_open(name.c_str(), O_RDONLY, 0);
+    shm_unlink(name.c_str());
+
+    uint8_t *const map = (reader_fd == -1 || ftruncate(fd, size) != 0) ? (uint8_t *)MAP_FAILED : (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        if (reader_fd != -1) {
+            close(reader_fd);
+        }
+
+        close(fd);
+        return map;
+    }
+#endif /* defined(__linux__) */
+
+    if (reader_fd == -1) {
+        munmap(map, size);
+        close(fd);
+        return (uint8_t *)MAP_FAILED;
+    }
+
+    *fd_out = fd;
+    *reader_fd_out = reader_fd;
+    return map;
+}
+
+static bool send_fd(const int socket, const int fd) {
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof (int))];
+    } control;
+    memset(&control, 0, sizeof (control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof (message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof (control.buffer);
+
+    struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof (int));
+
+    return sendmsg(socket, &message, 0) == 1;
+}
+
+FrameExport::FrameExport(const std::string socket_path, const unsigned int slot_count, const bool full_yuv) : _socket_path(socket_path), _slot_count(slot_count), _full_yuv(full_yuv), _fd(-1), _readonly_fd(-1), _map(NULL), _map_size(0), _width(0), _height(0), _write_count(0), _stopping(false) {
+    assert(slot_count > 0);
+    _listen_fd = listen_unix_socket(socket_path);
+
+    if (_listen_fd == -1) {
+        LOG(LOG_ERROR, "couldn't listen on %s: %s", socket_path.c_str(), strerror(errno));
+        abort();
+    }
+
+    _accept_thread = std::thread(&FrameExport::accept_main, this);
+}
+
+void FrameExport::accept_main() {
+    while (!_stopping) {
+        struct pollfd pfd = { _listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+
+        const int fd = accept(_listen_fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+
+        // Until the first frame arrives there's nothing to share; the reader sees the connection close and can retry.
+        const int readonly_fd = _readonly_fd;
+        if (readonly_fd != -1) {
+            send_fd(fd, readonly_fd);
+        }
+
+        close(fd);
+    }
+}
+
+// Returns false if the shared memory couldn't be set up.
+bool FrameExport::create(const int width, const int height) {
+    const size_t luma_size = (size_t)width * height;
+    const size_t chroma_size = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    const size_t pixels_size = _full_yuv ? (luma_size + 2 * chroma_size) : luma_size;
+
+    // Round slots up to a cache line so that neighboring slots' headers don't share one.
+    const size_t slot_size = (sizeof (FrameExportSlot) + pixels_size + 63) & ~(size_t)63;
+    _map_size = sizeof (FrameExportHeader) + _slot_count * slot_size;
+
+    int readonly_fd;
+    uint8_t *const map = create_shared_memory(_map_size, &_fd, &readonly_fd);
+
+    if (map == MAP_FAILED) {
+        LOG(LOG_WARNING, "frame export: couldn't create shared memory: %s", strerror(errno));
+        return false;
+    }
+
+    _map = map;
+
+    FrameExportHeader *const header = (FrameExportHeader *)_map;
+    memcpy(header->magic, FRAME_EXPORT_MAGIC, sizeof (header->magic));
+    header->version = FRAME_EXPORT_VERSION;
+    header->slot_count = _slot_count;
+    header->slot_size = slot_size;
+    header->write_count = 0;
+
+    _width = width;
+    _height = height;
+    _readonly_fd = readonly_fd;
+
+    LOG(LOG_INFO, "frame export: %u slots of %dx%d %s on %s", _slot_count, width, height, _full_yuv ? "I420" : "luma", _socket_path.c_str());
+    return true;
+}
+
+// Copies a plane, scaling samples to 8 bits.
+template <typename Format>
+static void copy_plane_8bit(const AVFrame *const frame, const int plane, const int sample_offset, const int sample_stride, const int width, const int height, uint8_t *const destination, const int destination_linesize) {
+    for (int y = 0; y < height; y++) {
+        const typename Format::Sample *const row = Format::row(frame, plane, y);
+        uint8_t *const destination_row = destination + y * destination_linesize;
+
+        for (int x = 0; x < width; x++) {
+            destination_row[x] = Format::to_8bit(row[sample_offset + x * sample_stride]);
+        }
+    }
+}
+
+bool FrameExport::publish(const AVFrame *const frame, const AVRational time_base, const uint32_t pixels_different, const uint32_t region_pixels, const bool interesting) {
+    if (_map == NULL && !create(frame->width, frame->height)) {
+        return false;
+    }
+
+    // The ring is sized for the first frame; skip anything that wouldn't fit (a mid-stream resolution change).
+    if (frame->width != _width || frame->height != _height) {
+        return true;
+    }
+
+    FrameExportHeader *const header = (FrameExportHeader *)_map;
+    const uint64_t n = _write_count;
+    uint8_t *const slot_base = _map + sizeof (FrameExportHeader) + (n % _slot_count) * header->slot_size;
+    FrameExportSlot *const slot = (FrameExportSlot *)slot_base;
+
+    // Mark the slot as being written before touching anything else in it.
+    __atomic_store_n(&slot->sequence, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    const int chroma_width = (_width + 1) / 2;
+    const int chroma_height = (_height + 1) / 2;
+
+    slot->pts = frame->pts;
+    slot->time_base_num = time_base.num;
+    slot->time_base_den = time_base.den;
+    slot->pixels_different = pixels_different;
+    slot->region_pixels = region_pixels;
+    slot->interesting = interesting ? 1 : 0;
+    slot->width = _width;
+    slot->height = _height;
+    slot->plane_count = _full_yuv ? 3 : 1;
+    slot->plane_offset[0] = sizeof (FrameExportSlot);
+    slot->plane_linesize[0] = _width;
+    slot->plane_offset[1] = _full_yuv ? (slot->plane_offset[0] + _width * _height) : 0;
+    slot->plane_linesize[1] = _full_yuv ? chroma_width : 0;
+    slot->plane_offset[2] = _full_yuv ? (slot->plane_offset[1] + chroma_width * chroma_height) : 0;
+    slot->plane_linesize[2] = _full_yuv ? chroma_width : 0;
+
+    dispatch_yuv420(frame->format, [&](const auto format) {
+        typedef decltype(format) Format;
+        copy_plane_8bit<Format>(frame, 0, 0, 1, _width, _height, slot_base + slot->plane_offset[0], slot->plane_linesize[0]);
+
+        if (_full_yuv) {
+            // Planar chroma is copied as is; interleaved chroma is split into separate U and V planes.
+            switch (Format::chroma_layout) {
+                case ChromaLayout::planar:
+                    copy_plane_8bit<Format>(frame, 1, 0, 1, chroma_width, chroma_height, slot_base + slot->plane_offset[1], chroma_width);
+                    copy_plane_8bit<Format>(frame, 2, 0, 1, chroma_width, chroma_height, slot_base + slot->plane_offset[2], chroma_width);
+                    break;
+                case ChromaLayout::interleaved_uv:
+                    copy_plane_8bit<Format>(frame, 1, 0, 2, chroma_width, chroma_height, slot_base + slot->plane_offset[1], chroma_width);
+                    copy_plane_8bit<Format>(frame, 1, 1, 2, chroma_width, chroma_height, slot_base + slot->plane_offset[2], chroma_width);
+                    break;
+                case ChromaLayout::interleaved_vu:
+                    copy_plane_8bit<Format>(frame, 1, 1, 2, chroma_width, chroma_height, slot_base + slot->plane_offset[1], chroma_width);
+                    copy_plane_8bit<Format>(frame, 1, 0, 2, chroma_width, chroma_height, slot_base + slot->plane_offset[2], chroma_width);
+                    break;
+            }
+        }
+    });
+
+    // Publish: the slot is complete, then the ring has one more frame.
+    __atomic_store_n(&slot->sequence, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->write_count, n + 1, __ATOMIC_RELEASE);
+    _write_count = n + 1;
+    return true;
+}
+
+FrameExport::~FrameExport() {
+    _stopping = true;
+    _accept_thread.join();
+    close(_listen_fd);
+    unlink(_socket_path.c_str());
+
+    if (_map != NULL) {
+        munmap(_map, _map_size);
+        close(_fd);
+        close(_readonly_fd);
+    }
+}
@@ -0,0 +1,85 @@
+//
+//  frame_export.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/rational.h>
+}
+
+#include "util.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#ifndef FRAME_EXPORT_H
+#define FRAME_EXPORT_H
+
+// Publishes decoded frames (8-bit luma, or 8-bit I420) and their motion scores to other local processes through a ring buffer in an anonymous shared-memory object.
+// Readers connect to a Unix domain socket and receive a file descriptor for the object (via SCM_RIGHTS), which they mmap read-only.  On Linux the object is sealed against writes; elsewhere the descriptor is opened O_RDONLY.
+//
+// Layout: a FrameExportHeader, then slot_count slots of slot_size bytes, each a FrameExportSlot followed by its pixels.
+// Frame n goes in slot n % slot_count.  The writer never waits for readers; readers detect overwritten slots with the slot's sequence counter:
+//     1. Read write_count (acquire).  If zero, nothing yet.  The newest frame is n = write_count - 1.
+//     2. Read the slot's sequence (acquire).  If it isn't 2n + 2, the slot is being (or has been) rewritten; retry.
+//     3. Copy out what's needed, then issue an acquire fence and re-read sequence.  If it changed, the copy may be torn; discard it.
+
+#define FRAME_EXPORT_MAGIC "SOPHFRM"
+#define FRAME_EXPORT_VERSION 1
+
+struct FrameExportHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint64_t write_count;
+};
+
+struct FrameExportSlot {
+    uint64_t sequence;            // odd while being written; 2n + 2 once frame n is complete
+    int64_t pts;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    uint32_t pixels_different;
+    uint32_t region_pixels;
+    uint32_t interesting;
+    uint32_t width;
+    uint32_t height;
+    uint32_t plane_count;         // 1 (luma only) or 3 (Y, U, V)
+    uint32_t plane_offset[3];     // from the start of the slot
+    uint32_t plane_linesize[3];
+};
+
+struct FrameExport : private DeleteImplicit {
+    FrameExport(std::string socket_path, unsigned int slot_count, bool full_yuv);
+    // Returns false if frame export couldn't be set up (on the first frame), in which case the caller should give up on it.
+    bool publish(const AVFrame *frame, AVRational time_base, uint32_t pixels_different, uint32_t region_pixels, bool interesting);
+    ~FrameExport();
+
+private:
+    bool create(int width, int height);
+    void accept_main();
+
+    std::string _socket_path;
+    unsigned int _slot_count;
+    bool _full_yuv;
+
+    int _fd;
+    std::atomic<int> _readonly_fd;
+    uint8_t *_map;
+    size_t _map_size;
+    int _width;
+    int _height;
+    uint64_t _write_count;
+
+    int _listen_fd;
+    std::thread _accept_thread;
+    std::atomic<bool> _stopping;
+};
+
+#endif /* FRAME_EXPORT_H */
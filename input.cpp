@@ -9,40 +9,65 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/avutil.h>
+#include <libavutil/time.h>
 }
 
 #include "input.h"
 #include "output.h"
+#include "live_server.h"
+#include "log.h"
+#include "segmenter.h"
+#include "trace.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
 
-Input::Input(const std::string filename) {
-    _input_ctx = NULL;
-    if (avformat_open_input(&_input_ctx, filename.c_str(), NULL, NULL) != 0) {
-        av_log(NULL, AV_LOG_ERROR, "Couldn't open file\n");
+// Demuxer options for a short time to first frame: probe less than FFmpeg's defaults (5 MB, 5 seconds) and don't buffer packets while probing.
+#define INPUT_PROBESIZE 500000
+#define INPUT_ANALYZE_DURATION_US 1000000
+
+// A network input that blocks this long (opening or reading) counts as dropped.
+#define INPUT_TIMEOUT_US 10000000
+
+#define INPUT_RECONNECT_MIN_DELAY_US 500000
+#define INPUT_RECONNECT_MAX_DELAY_US 30000000
+
+// Protocols that carry live streams, which drop rather than end.  Anything else (files, including file:// and http(s):// URLs) ends at EOF.
+static const char *const live_protocols[] = { "rtsp", "rtsps", "rtmp", "rtmps", "rtp", "udp", "srt", "tcp" };
+
+Input::Input(const std::string filename) : _filename(filename), _deadline(0), _offset_us(0), _pts_offset{ 0, 0 }, _last_dts_us(0), _last_packet_time(av_gettime_relative()), _rebase_pending(false), _reconnected(false) {
+    // Files end; live streams drop, and are worth reconnecting to.
+    const size_t scheme_end = filename.find("://");
+    const std::string scheme = (scheme_end != std::string::npos) ? filename.substr(0, scheme_end) : "";
+    _is_network = !scheme.empty() && scheme != "file";
+    _is_live = std::find(std::begin(live_protocols), std::end(live_protocols), scheme) != std::end(live_protocols);
+
+    _input_ctx = open_format_context();
+    if (_input_ctx == NULL) {
+        LOG(LOG_ERROR, "couldn't open %s", filename.c_str());
         abort();
     }
 
-    if (avformat_find_stream_info(_input_ctx, NULL) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Couldn't find stream information\n");
+    if (!find_streams(false)) {
+        LOG(LOG_ERROR, "couldn't find stream information");
         abort();
     }
 
-    const AVCodec *video_codec;
-    const AVCodec *audio_codec;
-    _video_stream_index = av_find_best_stream(_input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &video_codec, 0);
-    _audio_stream_index = av_find_best_stream(_input_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &audio_codec, 0);
-    assert(_video_stream_index >= 0);
-    assert(_audio_stream_index >= 0);
+    AVStream *const video_stream = _input_ctx->streams[_video_stream_index];
+    AVStream *const audio_stream = _input_ctx->streams[_audio_stream_index];
+    const AVCodec *const video_codec = avcodec_find_decoder(video_stream->codecpar->codec_id);
+    const AVCodec *const audio_codec = avcodec_find_decoder(audio_stream->codecpar->codec_id);
     assert(video_codec != NULL);
     assert(audio_codec != NULL);
 
-    // Get the codec parameterses for the streams.
-    AVStream *const video_stream = _input_ctx->streams[_video_stream_index];
-    AVStream *const audio_stream = _input_ctx->streams[_audio_stream_index];
-    _video_codecpar = video_stream->codecpar;
-    _audio_codecpar = audio_stream->codecpar;
+    // Keep our own copies of the codec parameterses and time bases, which outlive any one connection.
+    _video_codecpar = avcodec_parameters_alloc();
+    avcodec_parameters_copy(_video_codecpar, video_stream->codecpar);
+    _audio_codecpar = avcodec_parameters_alloc();
+    avcodec_parameters_copy(_audio_codecpar, audio_stream->codecpar);
+    _time_base[0] = video_stream->time_base;
+    _time_base[1] = audio_stream->time_base;
 
     // Create codec contexts.
     _video_codec_ctx = avcodec_alloc_context3(video_codec);
@@ -53,12 +78,12 @@ Input::Input(const std::string filename) {
 
     // Open codec contexts.
     if (avcodec_open2(_video_codec_ctx, video_codec, NULL) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot open video decoder\n");
+        LOG(LOG_ERROR, "couldn't open video decoder");
         abort();
     }
 
     if (avcodec_open2(_audio_codec_ctx, audio_codec, NULL) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot open audio decoder\n");
+        LOG(LOG_ERROR, "couldn't open audio decoder");
         abort();
     }
 
@@ -68,12 +93,147 @@ Input::Input(const std::string filename) {
     avformat_seek_file(_input_ctx, _video_stream_index, 0, 0, 0, AVSEEK_FLAG_FRAME);
 
     av_dump_format(_input_ctx, 0, filename.c_str(), 0);
-    fprintf(stderr, "input video timebases: stream = %s, codec = %s\n", timebase_str(video_stream->time_base).c_str(), timebase_str(_video_codec_ctx->time_base).c_str());
-    fprintf(stderr, "input audio timebases: stream = %s, codec = %s\n", timebase_str(audio_stream->time_base).c_str(), timebase_str(_audio_codec_ctx->time_base).c_str());
+    LOG(LOG_INFO, "input video timebases: stream = %s, codec = %s", timebase_str(video_stream->time_base).c_str(), timebase_str(_video_codec_ctx->time_base).c_str());
+    LOG(LOG_INFO, "input audio timebases: stream = %s, codec = %s", timebase_str(audio_stream->time_base).c_str(), timebase_str(_audio_codec_ctx->time_base).c_str());
+}
+
+int Input::interrupt(void *const opaque) {
+    const Input *const input = (const Input *)opaque;
+    return input->_deadline != 0 && av_gettime_relative() > input->_deadline;
+}
+
+// Returns NULL on failure.
+AVFormatContext *Input::open_format_context() {
+    AVFormatContext *ctx = avformat_alloc_context();
+    assert(ctx != NULL);
+
+    if (_is_network) {
+        ctx->interrupt_callback.callback = interrupt;
+        ctx->interrupt_callback.opaque = this;
+        _deadline = av_gettime_relative() + INPUT_TIMEOUT_US;
+    }
+
+    AVDictionary *options = NULL;
+    av_dict_set_int(&options, "probesize", INPUT_PROBESIZE, 0);
+    av_dict_set_int(&options, "analyzeduration", INPUT_ANALYZE_DURATION_US, 0);
+    av_dict_set(&options, "fflags", "nobuffer", 0);
+
+    // NOTE: avformat_open_input() frees the context on failure.
+    const int rv = avformat_open_input(&ctx, _filename.c_str(), NULL, &options);
+    av_dict_free(&options);
+
+    return (rv == 0) ? ctx : NULL;
+}
+
+// The decoders, every recording and sink, and the detector were set up for the original streams.
+static bool video_parameters_match(const AVCodecParameters *const a, const AVCodecParameters *const b) {
+    return a->codec_id == b->codec_id && a->width == b->width && a->height == b->height && a->format == b->format;
+}
+
+bool Input::find_streams(const bool reconnecting) {
+    // On reconnection, the first connection's stream parameters almost always still apply.  If the demuxer already knows the same codecs and picture size, skip probing and reuse them.
+    bool use_cached_parameters = false;
+
+    if (reconnecting) {
+        const int video_index = av_find_best_stream(_input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        const int audio_index = av_find_best_stream(_input_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+
+        use_cached_parameters = video_index >= 0 && audio_index >= 0 &&
+            video_parameters_match(_input_ctx->streams[video_index]->codecpar, _video_codecpar) &&
+            _input_ctx->streams[audio_index]->codecpar->codec_id == _audio_codecpar->codec_id;
+    }
+
+    if (!use_cached_parameters && avformat_find_stream_info(_input_ctx, NULL) < 0) {
+        return false;
+    }
+
+    _video_stream_index = av_find_best_stream(_input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    _audio_stream_index = av_find_best_stream(_input_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+
+    if (_video_stream_index < 0 || _audio_stream_index < 0) {
+        return false;
+    }
+
+    if (reconnecting) {
+        AVCodecParameters *const video_codecpar = _input_ctx->streams[_video_stream_index]->codecpar;
+        AVCodecParameters *const audio_codecpar = _input_ctx->streams[_audio_stream_index]->codecpar;
+
+        if (!video_parameters_match(video_codecpar, _video_codecpar) || audio_codecpar->codec_id != _audio_codecpar->codec_id) {
+            LOG(LOG_ERROR, "input: stream parameters changed across reconnection (video %dx%d -> %dx%d)", _video_codecpar->width, _video_codecpar->height, video_codecpar->width, video_codecpar->height);
+            abort();
+        }
+
+        if (use_cached_parameters) {
+            avcodec_parameters_copy(video_codecpar, _video_codecpar);
+            avcodec_parameters_copy(audio_codecpar, _audio_codecpar);
+        }
+    }
+
+    return true;
+}
+
+// Blocks until the input is back.  Decoders are flushed, but everything downstream carries on.
+void Input::reconnect() {
+    TRACE_SPAN("reconnect");
+    const int64_t dropped_time = av_gettime_relative();
+    avformat_close_input(&_input_ctx);
+
+    avcodec_flush_buffers(_video_codec_ctx);
+    avcodec_flush_buffers(_audio_codec_ctx);
+
+    for (int64_t delay = INPUT_RECONNECT_MIN_DELAY_US;; delay = std::min(delay * 2, (int64_t)INPUT_RECONNECT_MAX_DELAY_US)) {
+        LOG(LOG_WARNING, "input: reconnecting in %.1f s", delay / 1000000.0);
+        av_usleep(delay);
+
+        _input_ctx = open_format_context();
+        if (_input_ctx == NULL) {
+            continue;
+        }
+
+        if (find_streams(true)) {
+            break;
+        }
+
+        avformat_close_input(&_input_ctx);
+    }
+
+    _rebase_pending = true;
+    _reconnected = true;
+    LOG(LOG_WARNING, "input: reconnected after %.1f s", (av_gettime_relative() - dropped_time) / 1000000.0);
+}
+
+// Puts packets from every connection on the first connection's timeline.
+void Input::rebase_packet(AVPacket *const packet, const bool is_audio) {
+    const int i = is_audio ? 1 : 0;
+    const int64_t now = av_gettime_relative();
+
+    av_packet_rescale_ts(packet, _input_ctx->streams[packet->stream_index]->time_base, _time_base[i]);
+
+    // At the first packet of either stream, carry on from the last packet before the drop, plus however long we were disconnected.
+    // The reconnection delay (at least INPUT_RECONNECT_MIN_DELAY_US) dwarfs any A/V interleaving skew, so the other stream stays monotonic too.
+    if (_rebase_pending && packet->dts != AV_NOPTS_VALUE) {
+        const int64_t dts_us = av_rescale_q(packet->dts, _time_base[i], AV_TIME_BASE_Q);
+        _offset_us = _last_dts_us + std::max(now - _last_packet_time, (int64_t)1) - dts_us;
+        _pts_offset[0] = av_rescale_q(_offset_us, AV_TIME_BASE_Q, _time_base[0]);
+        _pts_offset[1] = av_rescale_q(_offset_us, AV_TIME_BASE_Q, _time_base[1]);
+        _rebase_pending = false;
+    }
+
+    if (packet->pts != AV_NOPTS_VALUE) {
+        packet->pts += _pts_offset[i];
+    }
+
+    if (packet->dts != AV_NOPTS_VALUE) {
+        packet->dts += _pts_offset[i];
+        _last_dts_us = std::max(_last_dts_us, av_rescale_q(packet->dts, _time_base[i], AV_TIME_BASE_Q));
+    }
+
+    _last_packet_time = now;
 }
 
 // Caller must free returned frame.
 AVFrame *Input::get_next_frame(bool *const is_audio_out) {
+    TRACE_SPAN("get_next_frame");
     AVPacket *packet = av_packet_alloc();
     AVFrame *frame = av_frame_alloc();
     bool got_frame = false;
@@ -90,18 +250,32 @@ AVFrame *Input::get_next_frame(bool *const is_audio_out) {
     }
 
     while (!got_frame) {
+        if (_is_network) {
+            _deadline = av_gettime_relative() + INPUT_TIMEOUT_US;
+        }
+
         const int rv = av_read_frame(_input_ctx, packet);
 
-        if (rv >= 0) {
+        if (rv >= 0 && packet->stream_index != _video_stream_index && packet->stream_index != _audio_stream_index) {
+            // Not a stream we decode.
+        } else if (rv >= 0) {
             const bool is_audio = packet->stream_index == _audio_stream_index;
+            rebase_packet(packet, is_audio);
 #if VERBOSE
             fprintf(stderr, "< read %s: dts %" PRId64 "\n", is_audio ? "audio" : "video", packet->dts);
 #endif /* VERBOSE */
 
-            AVStream *const stream = _input_ctx->streams[packet->stream_index];
+            for (PacketSink *const sink : _packet_sinks) {
+                sink->write_packet(packet, is_audio);
+            }
+
             AVCodecContext *const codec_ctx = is_audio ? _audio_codec_ctx : _video_codec_ctx;
 
-            if (avcodec_send_packet(codec_ctx, packet) < 0) {
+            const int send_rv = avcodec_send_packet(codec_ctx, packet);
+            if (send_rv < 0) {
+                char error[AV_ERROR_MAX_STRING_SIZE];
+                av_strerror(send_rv, error, sizeof (error));
+                LOG(LOG_ERROR, "input: decoding %s failed: %s", is_audio ? "audio" : "video", error);
                 abort();
             }
 
@@ -109,8 +283,19 @@ AVFrame *Input::get_next_frame(bool *const is_audio_out) {
                 assert(frame->pts >= 0);
                 got_frame = true;
             }
+        } else if (_is_live && rv != AVERROR(EAGAIN)) {
+            char error[AV_ERROR_MAX_STRING_SIZE];
+            av_strerror(rv, error, sizeof (error));
+            LOG(LOG_WARNING, "input: stream dropped: %s", error);
+            reconnect();
         } else if (rv == AVERROR_EOF) {
             break;
+        } else if (_is_network && rv != AVERROR(EAGAIN)) {
+            // A remote file that stops partway through (or times out) just ends early.
+            char error[AV_ERROR_MAX_STRING_SIZE];
+            av_strerror(rv, error, sizeof (error));
+            LOG(LOG_WARNING, "input: read failed: %s", error);
+            break;
         }
 
         // av_read_frame() doesn't unref the packet first, so we need this here in case we loop back around.
@@ -136,11 +321,32 @@ AVFrame *Input::get_next_frame(bool *const is_audio_out) {
 }
 
 AVRational Input::video_frame_time_base() {
-    return _input_ctx->streams[_video_stream_index]->time_base;
+    return _time_base[0];
 }
 
-Output *Input::create_output(const std::string filename) {
-    return new Output(filename, _video_codecpar, _audio_codecpar, _input_ctx->streams[_video_stream_index]->time_base, _input_ctx->streams[_audio_stream_index]->time_base);
+Output *Input::create_output(const std::string filename, const bool fragmented, EncoderGovernor *const governor) {
+    TRACE_SPAN("create_output");
+    const AVRational video_frame_rate = av_guess_frame_rate(_input_ctx, _input_ctx->streams[_video_stream_index], NULL);
+    return new Output(filename, _video_codecpar, _audio_codecpar, _time_base[0], _time_base[1], video_frame_rate, fragmented, governor);
+}
+
+Segmenter *Input::create_segmenter(const std::string directory) {
+    return new Segmenter(directory, _video_codecpar, _audio_codecpar, _time_base[0], _time_base[1]);
+}
+
+LiveServer *Input::create_live_server(const std::string socket_path, const std::string format) {
+    return new LiveServer(socket_path, format, _video_codecpar, _audio_codecpar, _time_base[0], _time_base[1]);
+}
+
+void Input::add_packet_sink(PacketSink *const sink) {
+    _packet_sinks.push_back(sink);
+}
+
+// Returns true once after each reconnection.  Frames on either side of the gap shouldn't be compared.
+bool Input::reconnected() {
+    const bool reconnected = _reconnected;
+    _reconnected = false;
+    return reconnected;
 }
 
 Input::~Input() {
@@ -148,5 +354,8 @@ Input::~Input() {
     avcodec_free_context(&_video_codec_ctx);
     avcodec_free_context(&_audio_codec_ctx);
 
-    avformat_free_context(_input_ctx);
+    avcodec_parameters_free(&_video_codecpar);
+    avcodec_parameters_free(&_audio_codecpar);
+
+    avformat_close_input(&_input_ctx);
 }
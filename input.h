@@ -13,17 +13,41 @@ extern "C" {
 #include "output.h"
 #include "util.h"
 #include <string>
+#include <vector>
 
 #ifndef INPUT_H
 #define INPUT_H
 
+struct Segmenter;
+struct LiveServer;
+
+// Receives every demuxed audio and video packet, before decoding.  The packet is only borrowed; sinks that keep it must take their own reference.
+struct PacketSink {
+    virtual void write_packet(const AVPacket *packet, bool is_audio) = 0;
+    virtual ~PacketSink() = default;
+};
+
 struct Input : private DeleteImplicit {
     Input(std::string filename);
     AVFrame *get_next_frame(bool *is_audio_out);
     AVRational video_frame_time_base();
-    Output *create_output(std::string filename);
+    Output *create_output(std::string filename, bool fragmented, EncoderGovernor *governor);
+    Segmenter *create_segmenter(std::string directory);
+    LiveServer *create_live_server(std::string socket_path, std::string format);
+    void add_packet_sink(PacketSink *sink);
+    bool reconnected();
     ~Input();
 private:
+    static int interrupt(void *opaque);
+    AVFormatContext *open_format_context();
+    bool find_streams(bool reconnecting);
+    void reconnect();
+    void rebase_packet(AVPacket *packet, bool is_audio);
+
+    std::string _filename;
+    bool _is_network;
+    bool _is_live;
+    int64_t _deadline;
     AVFormatContext *_input_ctx;
     int _video_stream_index;
     int _audio_stream_index;
@@ -31,6 +55,18 @@ private:
     AVCodecParameters *_audio_codecpar;
     AVCodecContext *_video_codec_ctx;
     AVCodecContext *_audio_codec_ctx;
+    std::vector<PacketSink *> _packet_sinks;
+
+    // Per stream (video, then audio): the first connection's time base.
+    AVRational _time_base[2];
+
+    // How packets from the current connection are shifted to continue from the last.  One shift applies to both streams, so each connection keeps its own A/V sync.
+    int64_t _offset_us;
+    int64_t _pts_offset[2];
+    int64_t _last_dts_us;
+    int64_t _last_packet_time;
+    bool _rebase_pending;
+    bool _reconnected;
 };
 
 static bool frame_is_audio(AVFrame *const frame) {
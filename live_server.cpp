@@ -0,0 +1,305 @@
+//
+//  live_server.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/mem.h>
+}
+
+#include "live_server.h"
+#include "log.h"
+#include "trace.h"
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <sys/socket.h>
+
+#define LIVE_AVIO_BUFFER_SIZE (32 * 1024)
+
+// A client with more than this much muxed data waiting to be sent is too slow, and gets dropped.
+#define LIVE_CLIENT_MAX_QUEUED_BYTES (4 * 1024 * 1024)
+
+struct LiveClient {
+    int fd;
+    AVFormatContext *output_ctx;
+    AVStream *video_stream;
+    AVStream *audio_stream;
+    int64_t epoch; // in the input video timebase
+
+    std::thread writer_thread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::vector<uint8_t>> queue;
+    size_t queued_bytes;
+    bool closing;
+
+    // Set by either side when the client should be torn down: it fell behind, or the socket went away.
+    std::atomic<bool> failed;
+};
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int client_write_packet(void *const opaque, const uint8_t *const buf, const int size) {
+#else /* LIBAVFORMAT_VERSION_MAJOR >= 61 */
+static int client_write_packet(void *const opaque, uint8_t *const buf, const int size) {
+#endif /* LIBAVFORMAT_VERSION_MAJOR >= 61 */
+    LiveClient *const client = (LiveClient *)opaque;
+
+    {
+        std::lock_guard<std::mutex> lock(client->mutex);
+
+        if (client->queued_bytes + size > LIVE_CLIENT_MAX_QUEUED_BYTES) {
+            client->failed = true;
+        } else {
+            client->queue.emplace_back(buf, buf + size);
+            client->queued_bytes += size;
+        }
+    }
+
+    client->condition.notify_one();
+
+    // Keep the muxer happy either way; a failed client is torn down after this packet.
+    return size;
+}
+
+static void client_writer_main(LiveClient *const client) {
+    trace_set_thread_name("live view writer");
+
+    for (;;) {
+        std::vector<uint8_t> chunk;
+
+        {
+            std::unique_lock<std::mutex> lock(client->mutex);
+            client->condition.wait(lock, [client] { return !client->queue.empty() || client->closing; });
+
+            if (client->queue.empty()) {
+                return;
+            }
+
+            chunk = std::move(client->queue.front());
+            client->queue.pop_front();
+            client->queued_bytes -= chunk.size();
+        }
+
+        TRACE_SPAN("live_view_write");
+        size_t written = 0;
+        while (written < chunk.size()) {
+            const ssize_t rv = write(client->fd, chunk.data() + written, chunk.size() - written);
+
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            } else if (rv <= 0) {
+                client->failed = true;
+                return;
+            }
+
+            written += rv;
+        }
+    }
+}
+
+LiveServer::LiveServer(const std::string socket_path, const std::string format, const AVCodecParameters *const video_codecpar, const AVCodecParameters *const audio_codecpar, const AVRational video_time_base, const AVRational audio_time_base) : _socket_path(socket_path), _format(format), _video_codecpar(video_codecpar), _audio_codecpar(audio_codecpar), _video_time_base(video_time_base), _audio_time_base(audio_time_base), _stopping(false) {
+    _listen_fd = listen_unix_socket(socket_path);
+
+    if (_listen_fd == -1) {
+        LOG(LOG_ERROR, "couldn't listen on %s: %s", socket_path.c_str(), strerror(errno));
+        abort();
+    }
+
+    _accept_thread = std::thread(&LiveServer::accept_main, this);
+    LOG(LOG_INFO, "live view (%s) on %s", format.c_str(), socket_path.c_str());
+}
+
+void LiveServer::accept_main() {
+    while (!_stopping) {
+        // Poll with a timeout, so we notice _stopping even where closing the socket doesn't wake accept().
+        struct pollfd pfd = { _listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+
+        const int fd = accept(_listen_fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+
+        LiveClient *const client = new LiveClient();
+        client->fd = fd;
+        client->output_ctx = NULL;
+        client->video_stream = NULL;
+        client->audio_stream = NULL;
+        client->epoch = 0;
+        client->queued_bytes = 0;
+        client->closing = false;
+        client->failed = false;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending_clients.push_back(client);
+    }
+}
+
+bool LiveServer::start_client(LiveClient *const client, const int64_t epoch) {
+    avformat_alloc_output_context2(&client->output_ctx, NULL, _format.c_str(), NULL);
+    if (client->output_ctx == NULL) {
+        return false;
+    }
+
+    client->video_stream = avformat_new_stream(client->output_ctx, NULL);
+    avcodec_parameters_copy(client->video_stream->codecpar, _video_codecpar);
+    client->video_stream->codecpar->codec_tag = 0;
+    client->video_stream->time_base = _video_time_base;
+
+    client->audio_stream = avformat_new_stream(client->output_ctx, NULL);
+    avcodec_parameters_copy(client->audio_stream->codecpar, _audio_codecpar);
+    client->audio_stream->codecpar->codec_tag = 0;
+    client->audio_stream->time_base = _audio_time_base;
+
+    // NOTE: FFmpeg may reallocate or free the AVIOContext's buffer itself, so it must come from av_malloc().
+    unsigned char *const avio_buffer = (unsigned char *)av_malloc(LIVE_AVIO_BUFFER_SIZE);
+    client->output_ctx->pb = avio_alloc_context(avio_buffer, LIVE_AVIO_BUFFER_SIZE, 1, client, NULL, client_write_packet, NULL);
+    client->output_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // A socket can't seek, so MP4 has to be fragmented, with the (empty) moov up front.
+    AVDictionary *format_options = NULL;
+    if (_format == "mp4") {
+        av_dict_set(&format_options, "movflags", "+frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+
+    const int rv = avformat_write_header(client->output_ctx, &format_options);
+    av_dict_free(&format_options);
+
+    if (rv < 0) {
+        return false;
+    }
+
+    client->epoch = epoch;
+    client->writer_thread = std::thread(client_writer_main, client);
+    return true;
+}
+
+void LiveServer::destroy_client(LiveClient *const client) {
+    // Unblock the writer if it's stuck in write() to a client that stopped reading.
+    shutdown(client->fd, SHUT_RDWR);
+
+    if (client->writer_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(client->mutex);
+            client->closing = true;
+        }
+
+        client->condition.notify_one();
+        client->writer_thread.join();
+    }
+
+    if (client->output_ctx != NULL) {
+        if (client->output_ctx->pb != NULL) {
+            av_freep(&client->output_ctx->pb->buffer);
+            avio_context_free(&client->output_ctx->pb);
+        }
+
+        avformat_free_context(client->output_ctx);
+    }
+
+    close(client->fd);
+    delete client;
+}
+
+void LiveServer::write_packet(const AVPacket *const packet, const bool is_audio) {
+    const bool is_keyframe = !is_audio && (packet->flags & AV_PKT_FLAG_KEY) && packet->dts != AV_NOPTS_VALUE;
+
+    // New clients start at a keyframe, so their first picture decodes.
+    if (is_keyframe) {
+        std::vector<LiveClient *> pending;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            pending.swap(_pending_clients);
+        }
+
+        for (LiveClient *const client : pending) {
+            if (start_client(client, packet->dts)) {
+                _clients.push_back(client);
+            } else {
+                LOG(LOG_WARNING, "live view: couldn't start client");
+                destroy_client(client);
+            }
+        }
+    }
+
+    for (LiveClient *const client : _clients) {
+        if (client->failed) {
+            continue;
+        }
+
+        const AVRational time_base = is_audio ? _audio_time_base : _video_time_base;
+        const int64_t epoch = av_rescale_q(client->epoch, _video_time_base, time_base);
+
+        if (packet->dts != AV_NOPTS_VALUE && packet->dts < epoch) {
+            continue;
+        }
+
+        AVPacket *copy = av_packet_clone(packet);
+        AVStream *const stream = is_audio ? client->audio_stream : client->video_stream;
+
+        // Leave missing timestamps missing.
+        if (copy->pts != AV_NOPTS_VALUE) {
+            copy->pts -= epoch;
+        }
+
+        if (copy->dts != AV_NOPTS_VALUE) {
+            copy->dts -= epoch;
+        }
+
+        av_packet_rescale_ts(copy, time_base, stream->time_base);
+        copy->stream_index = stream->index;
+        copy->pos = -1;
+
+        // Packets arrive in demux order, which is already interleaved, so skip the interleaving queue and push each one out right away.
+        if (av_write_frame(client->output_ctx, copy) < 0) {
+            client->failed = true;
+        } else {
+            avio_flush(client->output_ctx->pb);
+        }
+
+        av_packet_free(&copy);
+        assert(copy == NULL);
+    }
+
+    // Drop clients that went away or couldn't keep up.
+    for (auto it = _clients.begin(); it != _clients.end();) {
+        LiveClient *const client = *it;
+
+        if (client->failed) {
+            LOG(LOG_INFO, "live view: dropping client");
+            destroy_client(client);
+            it = _clients.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+LiveServer::~LiveServer() {
+    _stopping = true;
+    _accept_thread.join();
+    close(_listen_fd);
+    unlink(_socket_path.c_str());
+
+    for (LiveClient *const client : _pending_clients) {
+        destroy_client(client);
+    }
+
+    for (LiveClient *const client : _clients) {
+        destroy_client(client);
+    }
+}
@@ -0,0 +1,58 @@
+//
+//  live_server.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "input.h"
+#include "util.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef LIVE_SERVER_H
+#define LIVE_SERVER_H
+
+struct LiveClient;
+
+// Republishes the camera's packets, as demuxed (no transcoding), to any number of local clients connected to a Unix domain socket.
+// Each client gets its own muxer (MPEG-TS, or fragmented MP4) starting at the next keyframe, and its own writer thread and bounded queue.
+// A client that falls too far behind is disconnected; it never holds up detection.
+struct LiveServer : public PacketSink, private DeleteImplicit {
+    LiveServer(std::string socket_path, std::string format, const AVCodecParameters *video_codecpar, const AVCodecParameters *audio_codecpar, AVRational video_time_base, AVRational audio_time_base);
+    void write_packet(const AVPacket *packet, bool is_audio) override;
+    ~LiveServer();
+
+private:
+    void accept_main();
+    bool start_client(LiveClient *client, int64_t epoch);
+    void destroy_client(LiveClient *client);
+
+    std::string _socket_path;
+    std::string _format;
+    const AVCodecParameters *_video_codecpar;
+    const AVCodecParameters *_audio_codecpar;
+    AVRational _video_time_base;
+    AVRational _audio_time_base;
+
+    int _listen_fd;
+    std::thread _accept_thread;
+    std::atomic<bool> _stopping;
+
+    // Accepted by the accept thread, waiting for a keyframe.  Guarded by _mutex.
+    std::mutex _mutex;
+    std::vector<LiveClient *> _pending_clients;
+
+    // Only touched on the thread calling write_packet().
+    std::vector<LiveClient *> _clients;
+};
+
+#endif /* LIVE_SERVER_H */
@@ -0,0 +1,275 @@
+//
+//  log.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+#include "log.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Records waiting for the writer.  At one frame record and one histogram per frame, this is several seconds of slack.
+#define LOG_QUEUE_RECORDS 1024
+
+// Formatted output is gathered into a buffer this size and written with one write().
+#define LOG_WRITE_BUFFER_SIZE 65536
+
+std::atomic<LogLevel> log_level(LOG_INFO);
+
+static LogRecord log_queue[LOG_QUEUE_RECORDS];
+static size_t log_queue_head;   // next record to write
+static size_t log_queue_count;
+static uint64_t log_dropped;
+static bool log_closing;
+static bool log_running;
+static std::mutex log_mutex;
+
+// Held while writing to stderr.  The writer holds it from taking a batch until the batch is written, so synchronous writes can't overtake queued records.
+// Lock order: log_output_mutex, then log_mutex.
+static std::mutex log_output_mutex;
+static std::condition_variable log_condition;
+static std::thread log_thread;
+
+static const char *const log_level_names[] = { "error", "warning", "info", "debug" };
+
+static int64_t log_now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Appends one formatted line for the record to buffer (which has `size` bytes free).  Returns the length written.
+static size_t format_record(const LogRecord &record, char *const buffer, const size_t size) {
+    const time_t seconds = record.time_us / 1000000;
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+
+    size_t length = 0;
+    auto append = [&](const char *const format, auto... arguments) {
+        if (length < size) {
+            const int rv = snprintf(buffer + length, size - length, format, arguments...);
+            length = std::min(length + (rv > 0 ? (size_t)rv : 0), size - 1);
+        }
+    };
+
+    append("%02d:%02d:%02d.%03d %s: ", tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(record.time_us / 1000 % 1000), log_level_names[record.level]);
+
+    switch (record.type) {
+        case LOG_RECORD_TEXT:
+            append("%s", record.text);
+            break;
+        case LOG_RECORD_FRAME:
+            append("%" PRIu32 ": %" PRIu32 " (region: %" PRIu32 " blocks, %" PRIu32 " pixels)%s", record.frame.index, record.frame.pixels_different, record.frame.region_blocks, record.frame.region_pixels, record.frame.interesting ? " ***" : "");
+            break;
+        case LOG_RECORD_HISTOGRAM:
+            for (int i = 0; i < record.histogram.bucket_count; i++) {
+                if (record.histogram.buckets[i] > 0) {
+                    append("%d - %d: %" PRIu32 ", ", i * record.histogram.bucket_size, (i + 1) * record.histogram.bucket_size - 1, record.histogram.buckets[i]);
+                }
+            }
+            break;
+    }
+
+    if (record.suppressed > 0) {
+        append(" (%" PRIu32 " similar suppressed)", record.suppressed);
+    }
+
+    append("\n");
+    return length;
+}
+
+static void write_all(const char *const buffer, const size_t size) {
+    size_t written = 0;
+
+    while (written < size) {
+        const ssize_t rv = write(STDERR_FILENO, buffer + written, size - written);
+
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        } else if (rv <= 0) {
+            return;
+        }
+
+        written += rv;
+    }
+}
+
+static void log_writer_main() {
+    static char buffer[LOG_WRITE_BUFFER_SIZE];
+    static LogRecord batch[64];
+
+    for (;;) {
+        size_t batch_count = 0;
+        uint64_t dropped;
+
+        {
+            std::unique_lock<std::mutex> lock(log_mutex);
+            log_condition.wait(lock, [] { return log_queue_count > 0 || log_closing; });
+
+            if (log_queue_count == 0) {
+                return;
+            }
+        }
+
+        std::lock_guard<std::mutex> output_lock(log_output_mutex);
+
+        {
+            // A synchronous write may have emptied the queue in the meantime; then there's nothing to do.
+            std::lock_guard<std::mutex> lock(log_mutex);
+
+            while (log_queue_count > 0 && batch_count < sizeof (batch) / sizeof (batch[0])) {
+                batch[batch_count++] = log_queue[log_queue_head];
+                log_queue_head = (log_queue_head + 1) % LOG_QUEUE_RECORDS;
+                log_queue_count--;
+            }
+
+            dropped = log_dropped;
+            log_dropped = 0;
+        }
+
+        size_t length = 0;
+
+        if (dropped > 0) {
+            length += snprintf(buffer, sizeof (buffer), "log: dropped %" PRIu64 " records\n", dropped);
+        }
+
+        for (size_t i = 0; i < batch_count; i++) {
+            // Leave room for a worst-case record; flush first if there isn't.
+            if (sizeof (buffer) - length < 1024) {
+                write_all(buffer, length);
+                length = 0;
+            }
+
+            length += format_record(batch[i], buffer + length, sizeof (buffer) - length);
+        }
+
+        write_all(buffer, length);
+    }
+}
+
+void log_start(const LogLevel level) {
+    log_set_level(level);
+
+    std::lock_guard<std::mutex> lock(log_mutex);
+    log_closing = false;
+    log_running = true;
+    log_thread = std::thread(log_writer_main);
+}
+
+void log_set_level(const LogLevel level) {
+    log_level.store(level, std::memory_order_relaxed);
+}
+
+void log_finish() {
+    {
+        std::lock_guard<std::mutex> lock(log_mutex);
+
+        if (!log_running) {
+            return;
+        }
+
+        log_closing = true;
+        log_running = false;
+    }
+
+    log_condition.notify_all();
+    log_thread.join();
+}
+
+void log_submit(LogRecord &record) {
+    record.time_us = log_now_us();
+
+    if (record.level != LOG_ERROR) {
+        std::unique_lock<std::mutex> lock(log_mutex);
+
+        if (log_running) {
+            if (log_queue_count == LOG_QUEUE_RECORDS) {
+                log_dropped++;
+                return;
+            }
+
+            log_queue[(log_queue_head + log_queue_count) % LOG_QUEUE_RECORDS] = record;
+            log_queue_count++;
+
+            lock.unlock();
+            log_condition.notify_one();
+            return;
+        }
+    }
+
+    // No writer, or an error: write it now, after whatever is still queued.
+    std::lock_guard<std::mutex> output_lock(log_output_mutex);
+    std::lock_guard<std::mutex> lock(log_mutex);
+    char buffer[1024];
+
+    if (log_dropped > 0) {
+        write_all(buffer, snprintf(buffer, sizeof (buffer), "log: dropped %" PRIu64 " records\n", log_dropped));
+        log_dropped = 0;
+    }
+
+    while (log_queue_count > 0) {
+        write_all(buffer, format_record(log_queue[log_queue_head], buffer, sizeof (buffer)));
+        log_queue_head = (log_queue_head + 1) % LOG_QUEUE_RECORDS;
+        log_queue_count--;
+    }
+
+    write_all(buffer, format_record(record, buffer, sizeof (buffer)));
+}
+
+void log_message(const LogLevel level, const uint32_t suppressed, const char *const format, ...) {
+    LogRecord record;
+    record.level = level;
+    record.type = LOG_RECORD_TEXT;
+    record.suppressed = suppressed;
+
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(record.text, sizeof (record.text), format, arguments);
+    va_end(arguments);
+
+    log_submit(record);
+}
+
+void log_frame(const LogLevel level, const uint32_t suppressed, const uint32_t index, const uint32_t pixels_different, const uint32_t region_blocks, const uint32_t region_pixels, const bool interesting) {
+    LogRecord record;
+    record.level = level;
+    record.type = LOG_RECORD_FRAME;
+    record.suppressed = suppressed;
+    record.frame.index = index;
+    record.frame.pixels_different = pixels_different;
+    record.frame.region_blocks = region_blocks;
+    record.frame.region_pixels = region_pixels;
+    record.frame.interesting = interesting;
+
+    log_submit(record);
+}
+
+bool LogRateLimit::allow(uint32_t *const suppressed_out) {
+    const int64_t now = log_now_us();
+
+    if (now - _window_start >= 1000000) {
+        _window_start = now;
+        _count = 0;
+    }
+
+    if (_count >= _per_second) {
+        _suppressed++;
+        return false;
+    }
+
+    _count++;
+    *suppressed_out = _suppressed;
+    _suppressed = 0;
+    return true;
+}
@@ -0,0 +1,123 @@
+//
+//  log.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+#include "util.h"
+#include <stdint.h>
+#include <atomic>
+
+#ifndef LOG_H
+#define LOG_H
+
+// Structured logging off the detection path.  Callers fill in a fixed-size record (preformatted text, or a binary frame score or histogram) and queue it without allocating;
+// a writer thread formats records and writes them to stderr in batches.  If the writer falls behind, records are dropped and counted rather than blocking the caller.
+// Errors are the exception: they usually come right before abort(), so they're written synchronously, after anything still queued.
+
+enum LogLevel {
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,
+    LOG_DEBUG,
+};
+
+#define LOG_TEXT_SIZE 232
+#define LOG_HISTOGRAM_MAX_BUCKETS 32
+
+enum LogRecordType {
+    LOG_RECORD_TEXT,
+    LOG_RECORD_FRAME,
+    LOG_RECORD_HISTOGRAM,
+};
+
+struct LogRecord {
+    int64_t time_us;        // wallclock
+    LogLevel level;
+    LogRecordType type;
+    uint32_t suppressed;    // records dropped by this call site's rate limit since the last one emitted
+
+    union {
+        char text[LOG_TEXT_SIZE];
+
+        struct {
+            uint32_t index;
+            uint32_t pixels_different;
+            uint32_t region_blocks;
+            uint32_t region_pixels;
+            bool interesting;
+        } frame;
+
+        struct {
+            uint16_t bucket_size;
+            uint16_t bucket_count;
+            uint32_t buckets[LOG_HISTOGRAM_MAX_BUCKETS];
+        } histogram;
+    };
+};
+
+extern std::atomic<LogLevel> log_level;
+
+static inline bool log_enabled(const LogLevel level) {
+    return level <= log_level.load(std::memory_order_relaxed);
+}
+
+// Until log_start(), and after log_finish(), records are written synchronously.
+void log_start(LogLevel level);
+void log_set_level(LogLevel level);
+void log_finish();
+
+void log_submit(LogRecord &record);
+void log_message(LogLevel level, uint32_t suppressed, const char *format, ...) __attribute__((format(printf, 3, 4)));
+void log_frame(LogLevel level, uint32_t suppressed, uint32_t index, uint32_t pixels_different, uint32_t region_blocks, uint32_t region_pixels, bool interesting);
+
+template <unsigned int bucket_size>
+void log_histogram(const LogLevel level, const uint32_t suppressed, const Histogram<bucket_size> &histogram) {
+    static_assert(Histogram<bucket_size>::bucket_count <= LOG_HISTOGRAM_MAX_BUCKETS, "histogram too fine for a log record");
+
+    LogRecord record;
+    record.level = level;
+    record.type = LOG_RECORD_HISTOGRAM;
+    record.suppressed = suppressed;
+    record.histogram.bucket_size = bucket_size;
+    record.histogram.bucket_count = Histogram<bucket_size>::bucket_count;
+
+    for (unsigned int i = 0; i < Histogram<bucket_size>::bucket_count; i++) {
+        record.histogram.buckets[i] = histogram.bucket(i);
+    }
+
+    log_submit(record);
+}
+
+// A per-call-site budget of records per second.  Not thread-safe: each call site should only log from one thread.
+struct LogRateLimit : private DeleteImplicit {
+    LogRateLimit(const uint32_t per_second) : _per_second(per_second), _window_start(0), _count(0), _suppressed(0) {}
+
+    bool allow(uint32_t *const suppressed_out);
+
+private:
+    const uint32_t _per_second;
+    int64_t _window_start;
+    uint32_t _count;
+    uint32_t _suppressed;
+};
+
+#define LOG_WITH(level, function, ...) do { \
+    if (log_enabled(level)) { \
+        function(level, 0, __VA_ARGS__); \
+    } \
+} while (0)
+
+#define LOG_RATE_LIMITED_WITH(level, per_second, function, ...) do { \
+    static LogRateLimit log_rate_limit(per_second); \
+    uint32_t log_suppressed; \
+    if (log_enabled(level) && log_rate_limit.allow(&log_suppressed)) { \
+        function(level, log_suppressed, __VA_ARGS__); \
+    } \
+} while (0)
+
+#define LOG(level, ...) LOG_WITH(level, log_message, __VA_ARGS__)
+#define LOG_RATE_LIMITED(level, per_second, ...) LOG_RATE_LIMITED_WITH(level, per_second, log_message, __VA_ARGS__)
+
+#endif /* LOG_H */
@@ -8,16 +8,143 @@
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
 }
 
 #include "output.h"
+#include "log.h"
+#include "trace.h"
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 
-Output::Output(const std::string filename, const AVCodecParameters *const video_codecpar, const AVCodecParameters *const audio_codecpar, const AVRational video_time_base, const AVRational audio_time_base) : _io_ctx(NULL), _epoch(0), _have_epoch(false) {
+#define FRAGMENT_SECONDS 2
+
+// Fraction of real time spent encoding (smoothed) above which we trade quality for speed, and below which we trade speed for quality.
+#define GOVERNOR_HIGH_LOAD 0.8
+#define GOVERNOR_LOW_LOAD 0.4
+#define GOVERNOR_SMOOTHING 0.05
+#define GOVERNOR_ADJUSTMENT_INTERVAL_FRAMES 30
+
+static const char *const x264_presets[] = { "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow" };
+static const int x264_preset_count = sizeof (x264_presets) / sizeof (x264_presets[0]);
+
+static int x264_preset_index(const std::string name) {
+    for (int i = 0; i < x264_preset_count; i++) {
+        if (name == x264_presets[i]) {
+            return i;
+        }
+    }
+
+    LOG(LOG_ERROR, "unknown x264 preset: %s", name.c_str());
+    abort();
+}
+
+bool is_encoder_preset(const std::string name) {
+    return std::find(x264_presets, x264_presets + x264_preset_count, name) != x264_presets + x264_preset_count;
+}
+
+bool encoder_presets_ordered(const std::string fastest_preset, const std::string slowest_preset) {
+    return x264_preset_index(fastest_preset) <= x264_preset_index(slowest_preset);
+}
+
+EncoderGovernor::EncoderGovernor(const std::string fastest_preset, const std::string slowest_preset, const int min_crf, const int max_crf) : _min_crf(min_crf), _max_crf(max_crf), _load(GOVERNOR_SMOOTHING), _peak_load(0), _frames_since_adjustment(0) {
+    _fastest_preset = x264_preset_index(fastest_preset);
+    _slowest_preset = x264_preset_index(slowest_preset);
+    assert(_fastest_preset <= _slowest_preset);
+    assert(_min_crf <= _max_crf);
+
+    // Start where we always used to be, and at x264's default CRF.
+    _preset = std::clamp(x264_preset_index("superfast"), _fastest_preset, _slowest_preset);
+    _crf = std::clamp(23, _min_crf, _max_crf);
+}
+
+// The current preset and CRF are pulled into the new bounds; a recording in progress picks up the CRF at its next adjustment.
+void EncoderGovernor::set_bounds(const std::string fastest_preset, const std::string slowest_preset, const int min_crf, const int max_crf) {
+    _fastest_preset = x264_preset_index(fastest_preset);
+    _slowest_preset = x264_preset_index(slowest_preset);
+    _min_crf = min_crf;
+    _max_crf = max_crf;
+    assert(_fastest_preset <= _slowest_preset);
+    assert(_min_crf <= _max_crf);
+
+    _preset = std::clamp(_preset, _fastest_preset, _slowest_preset);
+    _crf = std::clamp(_crf, _min_crf, _max_crf);
+}
+
+const char *EncoderGovernor::preset() const {
+    return x264_presets[_preset];
+}
+
+int EncoderGovernor::crf() const {
+    return _crf;
+}
+
+bool EncoderGovernor::record_frame(const double encode_seconds, const double frame_interval_seconds) {
+    if (frame_interval_seconds <= 0) {
+        return false;
+    }
+
+    _load.append(encode_seconds / frame_interval_seconds);
+    _peak_load = std::max(_peak_load, _load.value());
+
+    if (++_frames_since_adjustment < GOVERNOR_ADJUSTMENT_INTERVAL_FRAMES) {
+        return false;
+    }
+
+    _frames_since_adjustment = 0;
+    const int old_crf = _crf;
+
+    if (_load.value() > GOVERNOR_HIGH_LOAD) {
+        _crf = std::min(_crf + 1, _max_crf);
+    } else if (_load.value() < GOVERNOR_LOW_LOAD) {
+        _crf = std::max(_crf - 1, _min_crf);
+    }
+
+    return _crf != old_crf;
+}
+
+void EncoderGovernor::recording_finished() {
+    const int old_preset = _preset;
+
+    if (_peak_load > GOVERNOR_HIGH_LOAD) {
+        _preset = std::max(_preset - 1, _fastest_preset);
+    } else if (_peak_load < GOVERNOR_LOW_LOAD) {
+        _preset = std::min(_preset + 1, _slowest_preset);
+    }
+
+    if (_preset != old_preset) {
+        LOG(LOG_INFO, "encoder governor: peak load %.2f; preset %s -> %s", _peak_load, x264_presets[old_preset], x264_presets[_preset]);
+    }
+
+    _load.reset();
+    _peak_load = 0;
+    _frames_since_adjustment = 0;
+}
+
+// An encoder that doesn't list its formats gets the benefit of the doubt; avcodec_open2() will say if not.
+static bool encoder_takes_format(const AVCodec *const codec, const enum AVPixelFormat format) {
+    if (codec->pix_fmts == NULL) {
+        return true;
+    }
+
+    for (const enum AVPixelFormat *f = codec->pix_fmts; *f != AV_PIX_FMT_NONE; f++) {
+        if (*f == format) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+Output::Output(const std::string filename, const AVCodecParameters *const video_codecpar, const AVCodecParameters *const audio_codecpar, const AVRational video_time_base, const AVRational audio_time_base, const AVRational video_frame_rate, const bool fragmented, EncoderGovernor *const governor) : _writer(NULL), _video_sws_ctx(NULL), _converted_video_frame(NULL), _epoch(0), _have_epoch(false), _governor(governor), _last_video_pts(AV_NOPTS_VALUE), _first_write_time(0) {
     const AVCodec *const video_codec = avcodec_find_encoder(video_codecpar->codec_id);
     const AVCodec *const audio_codec = avcodec_find_encoder(audio_codecpar->codec_id);
 
@@ -33,10 +160,29 @@ Output::Output(const std::string filename, const AVCodecParameters *const video_
     _video_stream->codecpar->codec_tag = av_codec_get_tag(_output_ctx->oformat->codec_tag, video_codec->id);
     _video_stream->codecpar->width = video_codecpar->width;
     _video_stream->codecpar->height = video_codecpar->height;
-    _video_stream->codecpar->format = video_codecpar->format;
-    _video_stream->codecpar->color_range = AVCOL_RANGE_MPEG;
-    _video_stream->codecpar->profile = video_codecpar->profile;
-    _video_stream->codecpar->level = video_codecpar->level;
+
+    // Detection takes pixel formats the encoder may not (libx264 can't take P010, and whether it takes NV21 depends on the build).  Convert those to the closest format it does.
+    const enum AVPixelFormat decoder_format = (enum AVPixelFormat)video_codecpar->format;
+    enum AVPixelFormat encoder_format = decoder_format;
+
+    if (!encoder_takes_format(video_codec, decoder_format)) {
+        encoder_format = avcodec_find_best_pix_fmt_of_list(video_codec->pix_fmts, decoder_format, 0, NULL);
+
+        if (encoder_format == AV_PIX_FMT_NONE) {
+            LOG(LOG_ERROR, "output: %s can't encode %s or anything it converts to", video_codec->name, av_get_pix_fmt_name(decoder_format));
+            abort();
+        }
+
+        LOG(LOG_INFO, "output: converting %s to %s for %s", av_get_pix_fmt_name(decoder_format), av_get_pix_fmt_name(encoder_format), video_codec->name);
+    }
+
+    _video_stream->codecpar->format = encoder_format;
+    _video_stream->codecpar->color_range = (video_codecpar->color_range != AVCOL_RANGE_UNSPECIFIED) ? video_codecpar->color_range : AVCOL_RANGE_MPEG;
+    _video_stream->codecpar->color_space = video_codecpar->color_space;
+
+    // The source's profile (High 10, say) may not fit a converted format.
+    _video_stream->codecpar->profile = (encoder_format == decoder_format) ? video_codecpar->profile : FF_PROFILE_UNKNOWN;
+    _video_stream->codecpar->level = (encoder_format == decoder_format) ? video_codecpar->level : FF_LEVEL_UNKNOWN;
 
     _audio_stream->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
     _audio_stream->codecpar->codec_id = audio_codecpar->codec_id;
@@ -57,8 +203,17 @@ Output::Output(const std::string filename, const AVCodecParameters *const video_
         _video_codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
 
+    // Fragments are cut at keyframes, so the keyframe interval bounds how far behind a reader tailing the file can be.
+    if (fragmented && video_frame_rate.num > 0 && video_frame_rate.den > 0) {
+        _video_codec_ctx->gop_size = (int)av_rescale(FRAGMENT_SECONDS, video_frame_rate.num, video_frame_rate.den);
+    }
+
     AVDictionary *codec_options = NULL;
-    av_dict_set(&codec_options, "preset", "superfast", 0);
+    av_dict_set(&codec_options, "preset", _governor ? _governor->preset() : "superfast", 0);
+
+    if (_governor) {
+        av_dict_set_int(&codec_options, "crf", _governor->crf(), 0);
+    }
 
     if (avcodec_open2(_video_codec_ctx, NULL, &codec_options) < 0) {
         abort();
@@ -69,6 +224,26 @@ Output::Output(const std::string filename, const AVCodecParameters *const video_
 
     avcodec_parameters_from_context(_video_stream->codecpar, _video_codec_ctx);
 
+    if (encoder_format != decoder_format) {
+        const int width = video_codecpar->width;
+        const int height = video_codecpar->height;
+
+        _video_sws_ctx = sws_getContext(width, height, decoder_format, width, height, encoder_format, SWS_BILINEAR, NULL, NULL, NULL);
+        assert(_video_sws_ctx != NULL);
+
+        // Only the layout and bit depth change; keep the samples' range as is.
+        const int full_range = (video_codecpar->color_range == AVCOL_RANGE_JPEG) ? 1 : 0;
+        sws_setColorspaceDetails(_video_sws_ctx, sws_getCoefficients(SWS_CS_DEFAULT), full_range, sws_getCoefficients(SWS_CS_DEFAULT), full_range, 0, 1 << 16, 1 << 16);
+
+        _converted_video_frame = av_frame_alloc();
+        _converted_video_frame->format = encoder_format;
+        _converted_video_frame->width = width;
+        _converted_video_frame->height = height;
+
+        const int rv = av_frame_get_buffer(_converted_video_frame, 0);
+        assert(rv == 0);
+    }
+
     // ---
 
     _audio_codec_ctx = avcodec_alloc_context3(audio_codec);
@@ -85,22 +260,40 @@ Output::Output(const std::string filename, const AVCodecParameters *const video_
 
     avcodec_parameters_from_context(_audio_stream->codecpar, _audio_codec_ctx);
 
-    if (avio_open(&_io_ctx, filename.c_str(), AVIO_FLAG_WRITE) < 0) {
-        abort();
-    }
+    // Muxed output goes through our own AVIOContext, which hands it off to a writer thread in large chunks.
+    _writer = new AsyncFileWriter(filename);
+    _output_ctx->pb = _writer->io_context();
+    _output_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
 
-    _output_ctx->pb = _io_ctx;
+    // By default the muxer flushes the AVIOContext after every packet, which would hand the writer one tiny chunk per packet.
+    // Let the buffer fill instead.  (In fragmented mode, the mov muxer still flushes at the end of each fragment.)
+    _output_ctx->flush_packets = 0;
 
-    if (avformat_write_header(_output_ctx, NULL) < 0) {
+    // In fragmented mode, write an empty moov up front and then a self-contained moof/mdat pair at each keyframe.
+    // Every fragment is playable as soon as it hits the disk, so a crash only loses the fragment in progress, and the trailer is just the (small) mfra index.
+    AVDictionary *format_options = NULL;
+    if (fragmented) {
+        av_dict_set(&format_options, "movflags", "+frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+
+    const int rv = avformat_write_header(_output_ctx, &format_options);
+    if (rv < 0) {
+        char error[AV_ERROR_MAX_STRING_SIZE];
+        av_strerror(rv, error, sizeof (error));
+        LOG(LOG_ERROR, "output: couldn't write header to %s: %s", filename.c_str(), error);
         abort();
     }
 
+    av_dict_free(&format_options);
+    assert(format_options == NULL);
+
     av_dump_format(_output_ctx, 0, filename.c_str(), 1);
-    fprintf(stderr, "output video timebases: stream = %s, codec = %s\n", timebase_str(_video_stream->time_base).c_str(), timebase_str(_video_codec_ctx->time_base).c_str());
-    fprintf(stderr, "output audio timebases: stream = %s, codec = %s\n", timebase_str(_audio_stream->time_base).c_str(), timebase_str(_audio_codec_ctx->time_base).c_str());
+    LOG(LOG_INFO, "output video timebases: stream = %s, codec = %s", timebase_str(_video_stream->time_base).c_str(), timebase_str(_video_codec_ctx->time_base).c_str());
+    LOG(LOG_INFO, "output audio timebases: stream = %s, codec = %s", timebase_str(_audio_stream->time_base).c_str(), timebase_str(_audio_codec_ctx->time_base).c_str());
 }
 
 void Output::encode_frame(AVFrame *const frame, const bool is_audio) {
+    TRACE_SPAN("encode_frame");
     // Abort if called after finish().
     assert(_output_ctx != NULL);
 
@@ -123,7 +316,22 @@ void Output::encode_frame(AVFrame *const frame, const bool is_audio) {
     fprintf(stderr, "> encode %s: %" PRId64 " (orig: %" PRId64 ")\n", is_audio ? "audio" : "video", frame->pts, original_pts);
 #endif /* VERBOSE */
 
-    if (avcodec_send_frame(codec_ctx, frame) < 0) {
+    const int64_t encode_start = av_gettime_relative();
+    AVFrame *encoded_frame = frame;
+
+    if (!is_audio && _video_sws_ctx != NULL) {
+        TRACE_SPAN("convert_frame");
+
+        // The encoder may still hold a reference to the last one.
+        const int rv = av_frame_make_writable(_converted_video_frame);
+        assert(rv == 0);
+
+        sws_scale(_video_sws_ctx, frame->data, frame->linesize, 0, frame->height, _converted_video_frame->data, _converted_video_frame->linesize);
+        av_frame_copy_props(_converted_video_frame, frame);
+        encoded_frame = _converted_video_frame;
+    }
+
+    if (avcodec_send_frame(codec_ctx, encoded_frame) < 0) {
         abort();
     }
 
@@ -131,6 +339,21 @@ void Output::encode_frame(AVFrame *const frame, const bool is_audio) {
     frame->pts = original_pts;
 
     flush(is_audio);
+
+    if (!is_audio && _governor != NULL) {
+        const double encode_seconds = (av_gettime_relative() - encode_start) / 1e6;
+
+        if (_last_video_pts != AV_NOPTS_VALUE && original_pts > _last_video_pts) {
+            const double frame_interval_seconds = (original_pts - _last_video_pts) * av_q2d(codec_ctx->time_base);
+
+            // NOTE: only libx264 reconfigures itself when its private "crf" option changes mid-stream.
+            if (_governor->record_frame(encode_seconds, frame_interval_seconds) && strcmp(codec_ctx->codec->name, "libx264") == 0) {
+                av_opt_set_int(codec_ctx->priv_data, "crf", _governor->crf(), 0);
+            }
+        }
+
+        _last_video_pts = original_pts;
+    }
 }
 
 void Output::flush(const bool is_audio) {
@@ -161,10 +384,18 @@ void Output::flush(const bool is_audio) {
 
         packet->stream_index = stream->index;
 
-        if (av_interleaved_write_frame(_output_ctx, packet) < 0) {
+        const int write_rv = av_interleaved_write_frame(_output_ctx, packet);
+        if (write_rv < 0) {
+            char error[AV_ERROR_MAX_STRING_SIZE];
+            av_strerror(write_rv, error, sizeof (error));
+            LOG(LOG_ERROR, "output: muxing %s failed: %s", is_audio ? "audio" : "video", error);
             abort();
         }
 
+        if (_first_write_time == 0) {
+            _first_write_time = av_gettime_relative();
+        }
+
         av_packet_unref(packet);
     }
 
@@ -172,7 +403,12 @@ void Output::flush(const bool is_audio) {
     assert(packet == NULL);
 }
 
+int64_t Output::first_write_time() const {
+    return _first_write_time;
+}
+
 void Output::finish() {
+    TRACE_SPAN("finish_output");
     avcodec_send_frame(_video_codec_ctx, NULL);
     flush(false);
 
@@ -188,13 +424,22 @@ void Output::finish() {
     avcodec_free_context(&_audio_codec_ctx);
     _audio_codec_ctx = NULL;
 
+    sws_freeContext(_video_sws_ctx);
+    _video_sws_ctx = NULL;
+    av_frame_free(&_converted_video_frame);
+
     avformat_free_context(_output_ctx);
     _output_ctx = NULL;
     _video_stream = NULL;
     _audio_stream = NULL;
 
-    avio_close(_io_ctx);
-    _io_ctx = NULL;
+    _writer->close();
+    delete _writer;
+    _writer = NULL;
+
+    if (_governor != NULL) {
+        _governor->recording_finished();
+    }
 }
 
 Output::~Output() {
@@ -8,30 +8,71 @@
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
 }
 
+#include "async_writer.h"
 #include "util.h"
 #include <stdint.h>
 
 #ifndef OUTPUT_H
 #define OUTPUT_H
 
+// Tunes x264 for recordings so that encoding keeps up with the camera, spending any leftover headroom on quality.
+// One governor is shared by successive Outputs, since load carries over from one event to the next.
+// CRF is adjusted on the live encoder; the preset can only change when an encoder is opened, so it's stepped between recordings.
+bool is_encoder_preset(std::string name);
+bool encoder_presets_ordered(std::string fastest_preset, std::string slowest_preset);
+
+struct EncoderGovernor : private DeleteImplicit {
+    EncoderGovernor(std::string fastest_preset, std::string slowest_preset, int min_crf, int max_crf);
+    void set_bounds(std::string fastest_preset, std::string slowest_preset, int min_crf, int max_crf);
+    const char *preset() const;
+    int crf() const;
+
+    // Records the wallclock time spent encoding one video frame against the time that frame covers.  Returns true if the CRF changed.
+    bool record_frame(double encode_seconds, double frame_interval_seconds);
+    void recording_finished();
+
+private:
+    int _fastest_preset;
+    int _slowest_preset;
+    int _preset;
+    int _min_crf;
+    int _max_crf;
+    int _crf;
+    EWMA _load;
+    double _peak_load;
+    unsigned int _frames_since_adjustment;
+};
+
 struct Output : private DeleteImplicit {
-    Output(std::string filename, const AVCodecParameters *video_codecpar, const AVCodecParameters *audio_codecpar, AVRational video_time_base, AVRational audio_time_base);
+    Output(std::string filename, const AVCodecParameters *video_codecpar, const AVCodecParameters *audio_codecpar, AVRational video_time_base, AVRational audio_time_base, AVRational video_frame_rate, bool fragmented, EncoderGovernor *governor);
     void encode_frame(AVFrame *frame, bool is_audio);
     void flush(bool is_audio);
     void finish();
+
+    // av_gettime_relative() when the first encoded packet went to the muxer, or 0 if none has yet.
+    int64_t first_write_time() const;
     ~Output();
 
 private:
     AVFormatContext *_output_ctx;
-    AVIOContext *_io_ctx;
+    AsyncFileWriter *_writer;
     AVStream *_video_stream;
     AVStream *_audio_stream;
     AVCodecContext *_video_codec_ctx;
     AVCodecContext *_audio_codec_ctx;
+
+    // Set if the encoder can't take the decoder's pixel format.
+    struct SwsContext *_video_sws_ctx;
+    AVFrame *_converted_video_frame;
+
     int64_t _epoch;
     bool _have_epoch;
+    EncoderGovernor *_governor;
+    int64_t _last_video_pts;
+    int64_t _first_write_time;
 };
 
 #endif /* OUTPUT_H */
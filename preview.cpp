@@ -0,0 +1,106 @@
+//
+//  preview.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+#include "preview.h"
+#include "yuv.h"
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+
+#define PREVIEW_TILE_WIDTH 160
+#define PREVIEW_COLUMNS 8
+#define PREVIEW_MAX_TILES 48
+
+static_assert(PREVIEW_MAX_TILES % 2 == 0, "compaction halves the tiles");
+
+EventPreview::EventPreview(const AVRational time_base, const double interval_seconds) : _next_pts(AV_NOPTS_VALUE), _tile_width(PREVIEW_TILE_WIDTH), _tile_height(0), _tile_count(0), _sws_ctx(NULL) {
+    _interval = std::max((int64_t)1, (int64_t)(interval_seconds * time_base.den / time_base.num));
+}
+
+uint8_t *EventPreview::tile(const unsigned int index) {
+    const unsigned int row = index / PREVIEW_COLUMNS;
+    const unsigned int column = index % PREVIEW_COLUMNS;
+    return _sheet.data() + row * _tile_height * rowbytes() + column * _tile_width * 4;
+}
+
+// Keeps tiles 0, 2, 4, ... in the first half of the sheet.
+void EventPreview::compact() {
+    for (unsigned int i = 1; i < _tile_count / 2; i++) {
+        uint8_t *const destination = tile(i);
+        const uint8_t *const source = tile(2 * i);
+
+        for (unsigned int y = 0; y < _tile_height; y++) {
+            memcpy(destination + y * rowbytes(), source + y * rowbytes(), _tile_width * 4);
+        }
+    }
+
+    _tile_count /= 2;
+    _interval *= 2;
+}
+
+void EventPreview::add_frame(const AVFrame *const frame) {
+    if (_next_pts != AV_NOPTS_VALUE && frame->pts < _next_pts) {
+        return;
+    }
+
+    if (_sheet.empty()) {
+        // Keep the frame's aspect ratio; swscale wants even dimensions for 4:2:0.
+        _tile_height = std::max(2, (int)(PREVIEW_TILE_WIDTH * frame->height / frame->width) & ~1);
+        _sheet.resize((size_t)PREVIEW_MAX_TILES / PREVIEW_COLUMNS * _tile_height * rowbytes());
+    }
+
+    if (_tile_count == PREVIEW_MAX_TILES) {
+        // The due sample falls on the doubled grid too, so it takes the first free tile.
+        compact();
+    }
+
+    // Scale straight from the decoded planes into the tile.
+    _sws_ctx = sws_getCachedContext(_sws_ctx, frame->width, frame->height, sws_format_for_frame(frame), _tile_width, _tile_height, AV_PIX_FMT_BGRA, SWS_AREA, NULL, NULL, NULL);
+    assert(_sws_ctx != NULL);
+    set_sws_colorspace_for_frame(_sws_ctx, frame);
+
+    uint8_t *const destination[4] = { tile(_tile_count), NULL, NULL, NULL };
+    const int destination_linesize[4] = { (int)rowbytes(), 0, 0, 0 };
+    sws_scale(_sws_ctx, frame->data, frame->linesize, 0, frame->height, destination, destination_linesize);
+
+    _tile_count++;
+    _next_pts = ((_next_pts == AV_NOPTS_VALUE) ? frame->pts : _next_pts) + _interval;
+
+    // After a gap (or a slow start), don't sample a burst of frames to catch up.
+    if (_next_pts <= frame->pts) {
+        _next_pts = frame->pts + _interval;
+    }
+}
+
+bool EventPreview::is_empty() const {
+    return _tile_count == 0;
+}
+
+const uint8_t *EventPreview::bytes() const {
+    return _sheet.data();
+}
+
+unsigned int EventPreview::width() const {
+    return PREVIEW_COLUMNS * _tile_width;
+}
+
+unsigned int EventPreview::height() const {
+    return (_tile_count + PREVIEW_COLUMNS - 1) / PREVIEW_COLUMNS * _tile_height;
+}
+
+unsigned int EventPreview::rowbytes() const {
+    return width() * 4;
+}
+
+EventPreview::~EventPreview() {
+    sws_freeContext(_sws_ctx);
+}
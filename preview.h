@@ -0,0 +1,52 @@
+//
+//  preview.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/rational.h>
+#include <libswscale/swscale.h>
+}
+
+#include "util.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+// A sprite sheet of small thumbnails across an event, built as frames go by so that nothing has to re-decode the recording.
+// Frames are sampled every `interval_seconds` of video.  When the sheet fills, every other tile is dropped and the interval doubled, so a long event is still covered end to end.
+struct EventPreview : private DeleteImplicit {
+    EventPreview(AVRational time_base, double interval_seconds);
+
+    // Video frames only, in presentation order.
+    void add_frame(const AVFrame *frame);
+
+    bool is_empty() const;
+
+    // BGRA, with as many rows of tiles as are in use.
+    const uint8_t *bytes() const;
+    unsigned int width() const;
+    unsigned int height() const;
+    unsigned int rowbytes() const;
+
+    ~EventPreview();
+
+private:
+    uint8_t *tile(unsigned int index);
+    void compact();
+
+    int64_t _interval;
+    int64_t _next_pts;
+    unsigned int _tile_width;
+    unsigned int _tile_height;
+    unsigned int _tile_count;
+    std::vector<uint8_t> _sheet;
+    struct SwsContext *_sws_ctx;
+};
+
+#endif /* PREVIEW_H */
@@ -0,0 +1,213 @@
+//
+//  segmenter.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "segmenter.h"
+#include "log.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <filesystem>
+
+#define SEGMENT_SECONDS 60
+
+Segmenter::Segmenter(const std::string directory, const AVCodecParameters *const video_codecpar, const AVCodecParameters *const audio_codecpar, const AVRational video_time_base, const AVRational audio_time_base) : _directory(directory), _video_codecpar(video_codecpar), _audio_codecpar(audio_codecpar), _video_time_base(video_time_base), _audio_time_base(audio_time_base), _segment{ NULL, NULL, NULL, NULL, 0 }, _previous_segment{ NULL, NULL, NULL, NULL, 0 } { }
+
+void Segmenter::open_segment(const int64_t epoch) {
+    assert(_segment.output_ctx == NULL);
+
+    const time_t t = time(NULL);
+    const std::string datestamp = datestamp_string(t);
+    std::filesystem::create_directory(_directory + "/" + datestamp);
+
+    const std::string relative_filename = datestamp + "/" + timestamp_string(t) + ".mp4";
+    const std::string filename = _directory + "/" + relative_filename;
+
+    AVFormatContext *output_ctx = NULL;
+    avformat_alloc_output_context2(&output_ctx, NULL, "mp4", filename.c_str());
+    assert(output_ctx);
+
+    // Stream copy: the codec parameters go across untouched, except for the tag, which is container-specific.
+    AVStream *const video_stream = avformat_new_stream(output_ctx, NULL);
+    avcodec_parameters_copy(video_stream->codecpar, _video_codecpar);
+    video_stream->codecpar->codec_tag = 0;
+    video_stream->time_base = _video_time_base;
+
+    AVStream *const audio_stream = avformat_new_stream(output_ctx, NULL);
+    avcodec_parameters_copy(audio_stream->codecpar, _audio_codecpar);
+    audio_stream->codecpar->codec_tag = 0;
+    audio_stream->time_base = _audio_time_base;
+
+    AsyncFileWriter *const writer = new AsyncFileWriter(filename);
+    output_ctx->pb = writer->io_context();
+    output_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    output_ctx->flush_packets = 0; // see Output::Output()
+
+    // Segments are fragmented for the same reason event recordings are: the one being written is always readable.
+    AVDictionary *format_options = NULL;
+    av_dict_set(&format_options, "movflags", "+frag_keyframe+empty_moov+default_base_moof", 0);
+
+    const int rv = avformat_write_header(output_ctx, &format_options);
+    if (rv < 0) {
+        char error[AV_ERROR_MAX_STRING_SIZE];
+        av_strerror(rv, error, sizeof (error));
+        LOG(LOG_ERROR, "segmenter: couldn't write header to %s: %s", filename.c_str(), error);
+        abort();
+    }
+
+    av_dict_free(&format_options);
+    assert(format_options == NULL);
+
+    _segment = { output_ctx, writer, video_stream, audio_stream, epoch };
+    _recent_segments.append({ relative_filename, epoch });
+
+    LOG(LOG_INFO, "starting segment %s", relative_filename.c_str());
+}
+
+void Segmenter::close_segment(OpenSegment &segment) {
+    if (segment.output_ctx == NULL) {
+        return;
+    }
+
+    av_write_trailer(segment.output_ctx);
+    avformat_free_context(segment.output_ctx);
+
+    segment.writer->close();
+    delete segment.writer;
+
+    segment = { NULL, NULL, NULL, NULL, 0 };
+}
+
+void Segmenter::write_segment_packet(OpenSegment &segment, const AVPacket *const packet, const bool is_audio) {
+    const AVRational time_base = is_audio ? _audio_time_base : _video_time_base;
+    const int64_t epoch = av_rescale_q(segment.epoch, _video_time_base, time_base);
+
+    AVPacket *copy = av_packet_clone(packet);
+    AVStream *const stream = is_audio ? segment.audio_stream : segment.video_stream;
+
+    // Leave missing timestamps missing.
+    if (copy->pts != AV_NOPTS_VALUE) {
+        copy->pts -= epoch;
+    }
+
+    if (copy->dts != AV_NOPTS_VALUE) {
+        copy->dts -= epoch;
+    }
+
+    av_packet_rescale_ts(copy, time_base, stream->time_base);
+    copy->stream_index = stream->index;
+    copy->pos = -1;
+
+    // NOTE: av_interleaved_write_frame() takes ownership of the packet's reference.
+    const int rv = av_interleaved_write_frame(segment.output_ctx, copy);
+    if (rv < 0) {
+        char error[AV_ERROR_MAX_STRING_SIZE];
+        av_strerror(rv, error, sizeof (error));
+        LOG(LOG_ERROR, "segmenter: muxing %s failed: %s", is_audio ? "audio" : "video", error);
+        abort();
+    }
+
+    av_packet_free(&copy);
+    assert(copy == NULL);
+}
+
+void Segmenter::write_packet(const AVPacket *const packet, const bool is_audio) {
+    if (!is_audio && (packet->flags & AV_PKT_FLAG_KEY) && packet->dts != AV_NOPTS_VALUE) {
+        const bool segment_full = _segment.output_ctx != NULL && packet->dts - _segment.epoch >= av_rescale(SEGMENT_SECONDS, _video_time_base.den, _video_time_base.num);
+
+        if (_segment.output_ctx == NULL || segment_full) {
+            close_segment(_previous_segment);
+            _previous_segment = _segment;
+            _segment = { NULL, NULL, NULL, NULL, 0 };
+            open_segment(packet->dts);
+        }
+    }
+
+    // Drop everything until the first keyframe; a segment that doesn't start with one isn't independently decodable.
+    if (_segment.output_ctx == NULL) {
+        return;
+    }
+
+    const int64_t epoch = av_rescale_q(_segment.epoch, _video_time_base, is_audio ? _audio_time_base : _video_time_base);
+
+    if (packet->dts != AV_NOPTS_VALUE && packet->dts < epoch) {
+        // Audio that straddles the cut belongs to the previous segment (and from before the first segment, nowhere).
+        if (is_audio && _previous_segment.output_ctx != NULL) {
+            write_segment_packet(_previous_segment, packet, is_audio);
+        }
+
+        return;
+    }
+
+    // Once the audio is past the cut, the previous segment is complete.
+    if (is_audio) {
+        close_segment(_previous_segment);
+    }
+
+    write_segment_packet(_segment, packet, is_audio);
+}
+
+bool Segmenter::locate(const int64_t video_pts, std::string *const filename_out, double *const offset_seconds_out) const {
+    for (size_t i = _recent_segments.count(); i > 0; i--) {
+        const SegmentInfo &segment = _recent_segments[i - 1];
+
+        if (video_pts >= segment.epoch) {
+            if (filename_out) *filename_out = segment.filename;
+            if (offset_seconds_out) *offset_seconds_out = (video_pts - segment.epoch) * av_q2d(_video_time_base);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Segmenter::finish() {
+    close_segment(_previous_segment);
+    close_segment(_segment);
+}
+
+Segmenter::~Segmenter() {
+    // Abort if finish() was never called.
+    assert(_segment.output_ctx == NULL);
+    assert(_previous_segment.output_ctx == NULL);
+}
+
+// ---
+
+MotionIndex::MotionIndex(const std::string directory) : _directory(directory), _fp(NULL) { }
+
+void MotionIndex::append(const std::string &segment_filename, const double offset_seconds, const uint32_t score) {
+    // File the entry in the segment's own day, so motion just after midnight in a segment opened before it stays next to that segment.
+    const std::string datestamp = segment_filename.substr(0, segment_filename.find('/'));
+
+    if (_fp == NULL || datestamp != _datestamp) {
+        if (_fp != NULL) {
+            fclose(_fp);
+        }
+
+        const std::string date_directory = _directory + "/" + datestamp;
+        std::filesystem::create_directory(date_directory);
+
+        _fp = fopen((date_directory + "/motion-index.txt").c_str(), "a");
+        assert(_fp);
+        _datestamp = datestamp;
+    }
+
+    fprintf(_fp, "%s\t%.3f\t%u\n", segment_filename.c_str(), offset_seconds, score);
+    fflush(_fp);
+}
+
+MotionIndex::~MotionIndex() {
+    if (_fp != NULL) {
+        fclose(_fp);
+    }
+}
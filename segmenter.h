@@ -0,0 +1,79 @@
+//
+//  segmenter.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "async_writer.h"
+#include "input.h"
+#include "util.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#ifndef SEGMENTER_H
+#define SEGMENTER_H
+
+// Stream-copies input packets into fixed-length, keyframe-aligned segments under <directory>/YYYY-MM-DD/.  Nothing is decoded or re-encoded.
+struct Segmenter : public PacketSink, private DeleteImplicit {
+    Segmenter(std::string directory, const AVCodecParameters *video_codecpar, const AVCodecParameters *audio_codecpar, AVRational video_time_base, AVRational audio_time_base);
+    void write_packet(const AVPacket *packet, bool is_audio) override;
+
+    // Finds the segment containing the given video PTS (in the input video timebase).  Returns false if it has already aged out or hasn't been written yet.
+    bool locate(int64_t video_pts, std::string *filename_out, double *offset_seconds_out) const;
+
+    void finish();
+    ~Segmenter();
+
+private:
+    struct SegmentInfo {
+        std::string filename; // relative to _directory
+        int64_t epoch;        // first DTS in the segment, in the input video timebase
+    };
+
+    struct OpenSegment {
+        AVFormatContext *output_ctx; // NULL if none
+        AsyncFileWriter *writer;
+        AVStream *video_stream;
+        AVStream *audio_stream;
+        int64_t epoch;
+    };
+
+    void open_segment(int64_t epoch);
+    void close_segment(OpenSegment &segment);
+    void write_segment_packet(OpenSegment &segment, const AVPacket *packet, bool is_audio);
+
+    std::string _directory;
+    const AVCodecParameters *_video_codecpar;
+    const AVCodecParameters *_audio_codecpar;
+    AVRational _video_time_base;
+    AVRational _audio_time_base;
+
+    OpenSegment _segment;
+
+    // Audio demuxed just after a cut can be timestamped before it.  The previous segment stays open for that audio until the audio passes the cut.
+    OpenSegment _previous_segment;
+
+    // Decoded frames lag the packets we see, so remember the last few segments for locate().
+    RingBuffer<SegmentInfo, 4> _recent_segments;
+};
+
+// Per-day text index of motion in continuous recordings: one "<segment>\t<offset seconds>\t<score>" line per triggered frame.
+struct MotionIndex : private DeleteImplicit {
+    MotionIndex(std::string directory);
+    void append(const std::string &segment_filename, double offset_seconds, uint32_t score);
+    ~MotionIndex();
+
+private:
+    std::string _directory;
+    std::string _datestamp;
+    FILE *_fp;
+};
+
+#endif /* SEGMENTER_H */
@@ -0,0 +1,559 @@
+//
+//  sophie-perftest.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+// End-to-end check that a change keeps both detection results and real-time headroom.
+// Generates deterministic clips, runs sophie over each, compares the recorded events against the golden timelines in perftest/, and checks speed and memory against budgets.
+// Given a directory of recorded camera clips, each <name>.mp4 with a golden <name>.events beside it, runs those too.
+// With -u, rewrites the golden timelines from this run's events instead of comparing, and reports the worst measurements to set the budgets from.
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+#include "event_index.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define CLIP_WIDTH 640
+#define CLIP_HEIGHT 480
+#define CLIP_FPS 30
+#define CLIP_SECONDS 20
+#define CLIP_SAMPLE_RATE 48000
+
+// How far a recorded event's start or end may stray from the golden timeline.
+#define PERFTEST_TIME_TOLERANCE_SECONDS 0.5
+
+// Budgets.  The minimum rate is twice real time for CLIP_FPS input, so that there's headroom for a live camera.
+// PROVISIONAL: these haven't been checked against a measured run yet.  Set them from the worst figures `make perftest-update` reports, with some margin.
+#define PERFTEST_MIN_FPS 60.0
+#define PERFTEST_MAX_RSS_MB 768.0
+#define PERFTEST_MAX_TRIGGER_LATENCY_MS 1000.0
+
+struct Blob {
+    int first_frame;
+    int last_frame;
+    int x;
+    int y;
+    int dx;
+};
+
+// A blob moving across the strike zone, as seen by the default detector parameters: 64x64, three pixels per frame.
+static const Blob moving_blob = { 4 * CLIP_FPS, 8 * CLIP_FPS - 1, 40, 200, 3 };
+static const Blob late_blob = { 11 * CLIP_FPS, 13 * CLIP_FPS - 1, 40, 300, 3 };
+
+static uint8_t background_luma(const int x, const int y) {
+    return 60 + (x + y) / 16;
+}
+
+static void draw_blob(AVFrame *const frame, const int index, const Blob &blob) {
+    if (index < blob.first_frame || index > blob.last_frame) {
+        return;
+    }
+
+    const int blob_x = blob.x + (index - blob.first_frame) * blob.dx;
+
+    for (int y = blob.y; y < std::min(blob.y + 64, CLIP_HEIGHT); y++) {
+        for (int x = blob_x; x < std::min(blob_x + 64, CLIP_WIDTH); x++) {
+            frame->data[0][y * frame->linesize[0] + x] = 220;
+        }
+    }
+}
+
+// Nothing moves.  Expect no events.
+static void draw_static(AVFrame *const frame, const int index) {
+}
+
+// One blob moves for four seconds.  Expect one event, from the third frame of motion until AFTER_MOTION_RECORD_SECONDS after the voter lets go.
+static void draw_blobs(AVFrame *const frame, const int index) {
+    draw_blob(frame, index, moving_blob);
+}
+
+// The scene slowly brightens (well under the pixel threshold per frame), then the lights snap on for one frame's worth of change.  Expect no events: the voter needs more than one interesting frame.
+static void draw_lighting(AVFrame *const frame, const int index) {
+    const int ramp_start = 3 * CLIP_FPS, ramp_end = 6 * CLIP_FPS, step = 10 * CLIP_FPS;
+    const int offset = (index < ramp_start) ? 0 : (index < ramp_end) ? (40 * (index - ramp_start) / (ramp_end - ramp_start)) : (index < step) ? 40 : 100;
+
+    for (int y = 0; y < CLIP_HEIGHT; y++) {
+        for (int x = 0; x < CLIP_WIDTH; x++) {
+            frame->data[0][y * frame->linesize[0] + x] = std::min(background_luma(x, y) + offset, 235);
+        }
+    }
+}
+
+// Sensor-like noise under the pixel threshold, with a blob late in the clip.  Expect one event, still open when the clip ends.
+static void draw_noise(AVFrame *const frame, const int index) {
+    uint32_t state = 0x50F1E + index;
+
+    for (int y = 0; y < CLIP_HEIGHT; y++) {
+        for (int x = 0; x < CLIP_WIDTH; x++) {
+            state = state * 1664525 + 1013904223;
+            const int noise = (int)(state >> 24) % 13 - 6;
+            frame->data[0][y * frame->linesize[0] + x] = background_luma(x, y) + noise;
+        }
+    }
+
+    draw_blob(frame, index, late_blob);
+}
+
+struct Scenario {
+    const char *name;
+    void (*draw)(AVFrame *frame, int index);
+};
+
+static const Scenario scenarios[] = {
+    { "static", draw_static },
+    { "blobs", draw_blobs },
+    { "lighting", draw_lighting },
+    { "noise", draw_noise },
+};
+
+static AVCodecContext *open_encoder(AVFormatContext *const output_ctx, const AVCodec *const codec, AVStream **const stream_out) {
+    AVCodecContext *const codec_ctx = avcodec_alloc_context3(codec);
+    assert(codec_ctx != NULL);
+
+    if (codec->type == AVMEDIA_TYPE_VIDEO) {
+        codec_ctx->width = CLIP_WIDTH;
+        codec_ctx->height = CLIP_HEIGHT;
+        codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+        codec_ctx->time_base = av_make_q(1, CLIP_FPS);
+        codec_ctx->framerate = av_make_q(CLIP_FPS, 1);
+        codec_ctx->gop_size = 2 * CLIP_FPS;
+        codec_ctx->max_b_frames = 0;
+    } else {
+        codec_ctx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+        codec_ctx->sample_rate = CLIP_SAMPLE_RATE;
+        codec_ctx->channel_layout = AV_CH_LAYOUT_MONO;
+        codec_ctx->channels = 1;
+        codec_ctx->time_base = av_make_q(1, CLIP_SAMPLE_RATE);
+    }
+
+    if (output_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    // Deterministic output: one thread, fixed quality, and high enough quality that the noise scenario's noise survives roughly as drawn.
+    AVDictionary *options = NULL;
+    av_dict_set(&options, "threads", "1", 0);
+
+    if (strcmp(codec->name, "libx264") == 0) {
+        av_dict_set(&options, "preset", "veryfast", 0);
+        av_dict_set(&options, "tune", "zerolatency", 0);
+        av_dict_set(&options, "crf", "16", 0);
+    }
+
+    if (avcodec_open2(codec_ctx, codec, &options) < 0) {
+        fprintf(stderr, "couldn't open %s encoder\n", codec->name);
+        abort();
+    }
+
+    av_dict_free(&options);
+
+    AVStream *const stream = avformat_new_stream(output_ctx, NULL);
+    assert(stream != NULL);
+    avcodec_parameters_from_context(stream->codecpar, codec_ctx);
+    stream->time_base = codec_ctx->time_base;
+
+    *stream_out = stream;
+    return codec_ctx;
+}
+
+// Sends frame (or NULL, to drain) and writes out whatever packets come back.
+static void encode(AVFormatContext *const output_ctx, AVCodecContext *const codec_ctx, AVStream *const stream, AVFrame *const frame) {
+    if (avcodec_send_frame(codec_ctx, frame) < 0) {
+        abort();
+    }
+
+    AVPacket *packet = av_packet_alloc();
+
+    while (avcodec_receive_packet(codec_ctx, packet) >= 0) {
+        av_packet_rescale_ts(packet, codec_ctx->time_base, stream->time_base);
+        packet->stream_index = stream->index;
+
+        if (av_interleaved_write_frame(output_ctx, packet) < 0) {
+            abort();
+        }
+    }
+
+    av_packet_free(&packet);
+}
+
+// Writes an H.264 video + AAC audio (silent) MP4, since sophie's Input expects both.
+static void write_clip(const Scenario &scenario, const std::string filename) {
+    AVFormatContext *output_ctx = NULL;
+    avformat_alloc_output_context2(&output_ctx, NULL, NULL, filename.c_str());
+    assert(output_ctx != NULL);
+
+    const AVCodec *video_codec = avcodec_find_encoder_by_name("libx264");
+    if (video_codec == NULL) video_codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    const AVCodec *const audio_codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+
+    if (video_codec == NULL || audio_codec == NULL) {
+        fprintf(stderr, "perftest needs H.264 and AAC encoders\n");
+        abort();
+    }
+
+    AVStream *video_stream, *audio_stream;
+    AVCodecContext *const video_ctx = open_encoder(output_ctx, video_codec, &video_stream);
+    AVCodecContext *const audio_ctx = open_encoder(output_ctx, audio_codec, &audio_stream);
+
+    if (avio_open(&output_ctx->pb, filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+        fprintf(stderr, "couldn't open %s\n", filename.c_str());
+        abort();
+    }
+
+    if (avformat_write_header(output_ctx, NULL) < 0) {
+        abort();
+    }
+
+    AVFrame *const video_frame = av_frame_alloc();
+    video_frame->format = video_ctx->pix_fmt;
+    video_frame->width = CLIP_WIDTH;
+    video_frame->height = CLIP_HEIGHT;
+    av_frame_get_buffer(video_frame, 0);
+
+    AVFrame *const audio_frame = av_frame_alloc();
+    audio_frame->format = audio_ctx->sample_fmt;
+    audio_frame->channel_layout = audio_ctx->channel_layout;
+    audio_frame->channels = audio_ctx->channels;
+    audio_frame->sample_rate = CLIP_SAMPLE_RATE;
+    audio_frame->nb_samples = audio_ctx->frame_size;
+    av_frame_get_buffer(audio_frame, 0);
+
+    int64_t audio_samples = 0;
+
+    for (int index = 0; index < CLIP_SECONDS * CLIP_FPS; index++) {
+        // Keep audio just ahead of video, so the muxer interleaves without buffering much.
+        while (audio_samples * CLIP_FPS <= (int64_t)index * CLIP_SAMPLE_RATE) {
+            av_frame_make_writable(audio_frame);
+            memset(audio_frame->data[0], 0, audio_frame->nb_samples * sizeof (float));
+            audio_frame->pts = audio_samples;
+            encode(output_ctx, audio_ctx, audio_stream, audio_frame);
+            audio_samples += audio_frame->nb_samples;
+        }
+
+        av_frame_make_writable(video_frame);
+
+        for (int y = 0; y < CLIP_HEIGHT; y++) {
+            for (int x = 0; x < CLIP_WIDTH; x++) {
+                video_frame->data[0][y * video_frame->linesize[0] + x] = background_luma(x, y);
+            }
+        }
+
+        for (int plane = 1; plane < 3; plane++) {
+            for (int y = 0; y < CLIP_HEIGHT / 2; y++) {
+                memset(video_frame->data[plane] + y * video_frame->linesize[plane], 128, CLIP_WIDTH / 2);
+            }
+        }
+
+        scenario.draw(video_frame, index);
+        video_frame->pts = index;
+        encode(output_ctx, video_ctx, video_stream, video_frame);
+    }
+
+    encode(output_ctx, video_ctx, video_stream, NULL);
+    encode(output_ctx, audio_ctx, audio_stream, NULL);
+    av_write_trailer(output_ctx);
+
+    AVFrame *frame_to_free = video_frame;
+    av_frame_free(&frame_to_free);
+    frame_to_free = audio_frame;
+    av_frame_free(&frame_to_free);
+
+    AVCodecContext *ctx_to_free = video_ctx;
+    avcodec_free_context(&ctx_to_free);
+    ctx_to_free = audio_ctx;
+    avcodec_free_context(&ctx_to_free);
+
+    avio_closep(&output_ctx->pb);
+    avformat_free_context(output_ctx);
+}
+
+// Runs sophie to completion with its log going to log_filename.  Returns false if it didn't exit cleanly.
+static bool run_sophie(const std::string sophie, const std::vector<std::string> arguments, const std::string log_filename, struct rusage *const usage) {
+    const pid_t pid = fork();
+    assert(pid != -1);
+
+    if (pid == 0) {
+        const int log_fd = open(log_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(log_fd, STDERR_FILENO);
+        close(log_fd);
+
+        std::vector<const char *> argv;
+        argv.push_back(sophie.c_str());
+        for (const std::string &argument : arguments) argv.push_back(argument.c_str());
+        argv.push_back(NULL);
+
+        execv(sophie.c_str(), (char *const *)argv.data());
+        _exit(127);
+    }
+
+    int status;
+    const pid_t rv = wait4(pid, &status, 0, usage);
+    assert(rv == pid);
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+struct Event {
+    double start;
+    double end;
+};
+
+// Gathers events from every day's index under the output directory.
+static std::vector<Event> read_events(const std::string output_dir) {
+    std::vector<Event> events;
+
+    for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(output_dir)) {
+        const std::string index_filename = entry.path().string() + "/events.idx";
+
+        if (!entry.is_directory() || !std::filesystem::exists(index_filename)) {
+            continue;
+        }
+
+        EventIndexReader reader(index_filename);
+        assert(reader.is_valid());
+
+        for (size_t i = 0; i < reader.count(); i++) {
+            const EventRecord &record = reader.records()[i];
+            const double time_base = (double)record.time_base_num / record.time_base_den;
+            events.push_back({ record.start_pts * time_base, record.end_pts * time_base });
+        }
+    }
+
+    std::sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.start < b.start; });
+    return events;
+}
+
+// Golden files have one `<start seconds> <end seconds>` line per event; `#` starts a comment.
+static std::vector<Event> read_golden(const std::string filename) {
+    std::ifstream file(filename);
+    std::vector<Event> events;
+    std::string line;
+
+    if (!file) {
+        fprintf(stderr, "couldn't open %s\n", filename.c_str());
+        exit(1);
+    }
+
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        Event event;
+
+        if (sscanf(line.c_str(), "%lf %lf", &event.start, &event.end) == 2) {
+            events.push_back(event);
+        }
+    }
+
+    return events;
+}
+
+static std::map<std::string, double> read_stats(const std::string filename) {
+    std::ifstream file(filename);
+    std::map<std::string, double> stats;
+    std::string key;
+    double value;
+
+    while (file >> key >> value) {
+        stats[key] = value;
+    }
+
+    return stats;
+}
+
+static void write_golden(const std::string filename, const std::vector<Event> &events) {
+    FILE *const fp = fopen(filename.c_str(), "w");
+
+    if (fp == NULL) {
+        fprintf(stderr, "couldn't open %s\n", filename.c_str());
+        exit(1);
+    }
+
+    fprintf(fp, "# Recorded by sophie-perftest -u.  Check these against the clip before committing.\n");
+
+    for (const Event &event : events) {
+        fprintf(fp, "%.2f %.2f\n", event.start, event.end);
+    }
+
+    fclose(fp);
+}
+
+static bool events_match(const std::vector<Event> &actual, const std::vector<Event> &expected) {
+    if (actual.size() != expected.size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < actual.size(); i++) {
+        if (fabs(actual[i].start - expected[i].start) > PERFTEST_TIME_TOLERANCE_SECONDS || fabs(actual[i].end - expected[i].end) > PERFTEST_TIME_TOLERANCE_SECONDS) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static std::string describe_events(const std::vector<Event> &events) {
+    std::string description;
+
+    for (const Event &event : events) {
+        char buffer[64];
+        snprintf(buffer, sizeof (buffer), "%s%.2f-%.2f", description.empty() ? "" : ", ", event.start, event.end);
+        description += buffer;
+    }
+
+    return description.empty() ? "(none)" : description;
+}
+
+// The worst figures over every clip, for setting the budgets from.
+struct Worst {
+    double fps = INFINITY;
+    double rss_mb = 0;
+    double latency_ms = 0;
+};
+
+// Runs sophie over one clip and checks (or, with update, rewrites) its golden timeline and the budgets.  Returns false on any failure.
+static bool run_clip(const std::string sophie, const std::string perftest_dir, const std::string work_dir, const std::string name, const std::string clip_filename, const std::string golden_filename, const bool update, Worst *const worst) {
+    const std::string output_dir = work_dir + "/" + name;
+    const std::string stats_filename = work_dir + "/" + name + "-stats.txt";
+
+    std::filesystem::remove_all(output_dir);
+    std::filesystem::create_directories(output_dir);
+
+    struct rusage usage;
+    if (!run_sophie(sophie, { "-c", perftest_dir + "/perftest.conf", "-s", stats_filename, clip_filename, output_dir }, work_dir + "/" + name + ".log", &usage)) {
+        printf("%-10s FAILED: sophie didn't exit cleanly (see %s.log)\n", name.c_str(), (work_dir + "/" + name).c_str());
+        return false;
+    }
+
+#if defined(__ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__)
+    const double peak_rss_mb = usage.ru_maxrss / (1024.0 * 1024.0);
+#else /* defined(__ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__) */
+    const double peak_rss_mb = usage.ru_maxrss / 1024.0;
+#endif /* defined(__ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__) */
+
+    std::map<std::string, double> stats = read_stats(stats_filename);
+    const double fps = stats["fps"];
+    const double latency_ms = stats["max_trigger_latency_ms"];
+    const bool recorded = stats["recordings"] > 0;
+
+    const std::vector<Event> actual = read_events(output_dir);
+
+    char latency[32];
+    snprintf(latency, sizeof (latency), recorded ? "%.0f ms" : "-", latency_ms);
+    printf("%-10s %8.1f %7.0f MB %16s  %s\n", name.c_str(), fps, peak_rss_mb, latency, describe_events(actual).c_str());
+
+    worst->fps = std::min(worst->fps, fps);
+    worst->rss_mb = std::max(worst->rss_mb, peak_rss_mb);
+    worst->latency_ms = recorded ? std::max(worst->latency_ms, latency_ms) : worst->latency_ms;
+
+    if (update) {
+        write_golden(golden_filename, actual);
+        return true;
+    }
+
+    const std::vector<Event> expected = read_golden(golden_filename);
+    bool passed = true;
+
+    if (!events_match(actual, expected)) {
+        printf("%-10s FAILED: expected events %s\n", "", describe_events(expected).c_str());
+        passed = false;
+    }
+
+    if (fps < PERFTEST_MIN_FPS) {
+        printf("%-10s FAILED: below %.0f fps budget\n", "", PERFTEST_MIN_FPS);
+        passed = false;
+    }
+
+    if (peak_rss_mb > PERFTEST_MAX_RSS_MB) {
+        printf("%-10s FAILED: over %.0f MB budget\n", "", PERFTEST_MAX_RSS_MB);
+        passed = false;
+    }
+
+    if (recorded && latency_ms > PERFTEST_MAX_TRIGGER_LATENCY_MS) {
+        printf("%-10s FAILED: over %.0f ms trigger latency budget\n", "", PERFTEST_MAX_TRIGGER_LATENCY_MS);
+        passed = false;
+    }
+
+    return passed;
+}
+
+int main(int argc, const char *argv[]) {
+    const bool update = argc > 1 && strcmp(argv[1], "-u") == 0;
+
+    if (update) {
+        argc--;
+        argv++;
+    }
+
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "usage:\n\tsophie-perftest [-u] <sophie binary> <perftest directory> <work directory> [<recorded clips directory>]\n");
+        exit(1);
+    }
+
+    const std::string sophie = argv[1];
+    const std::string perftest_dir = argv[2];
+    const std::string work_dir = argv[3];
+    Worst worst;
+
+    av_log_set_level(AV_LOG_WARNING);
+    std::filesystem::create_directories(work_dir);
+    bool passed = true;
+
+    printf("%-10s %8s %10s %16s  %s\n", "scenario", "fps", "peak RSS", "trigger latency", "events");
+
+    for (const Scenario &scenario : scenarios) {
+        const std::string name = scenario.name;
+        const std::string clip_filename = work_dir + "/" + name + ".mp4";
+
+        write_clip(scenario, clip_filename);
+        passed = run_clip(sophie, perftest_dir, work_dir, name, clip_filename, perftest_dir + "/" + name + ".events", update, &worst) && passed;
+    }
+
+    // Recorded clips are too big to keep in the tree, so they live wherever the caller keeps them, each <name>.mp4 next to its <name>.events.
+    if (argc == 5) {
+        std::vector<std::filesystem::path> clips;
+
+        for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(argv[4])) {
+            if (entry.is_regular_file() && entry.path().extension() == ".mp4") {
+                clips.push_back(entry.path());
+            }
+        }
+
+        std::sort(clips.begin(), clips.end());
+
+        for (const std::filesystem::path &clip : clips) {
+            const std::string name = clip.stem().string();
+            std::filesystem::path golden = clip;
+            golden.replace_extension(".events");
+
+            passed = run_clip(sophie, perftest_dir, work_dir, "recorded-" + name, clip.string(), golden.string(), update, &worst) && passed;
+        }
+    }
+
+    if (update) {
+        printf("updated golden timelines; worst: %.1f fps, %.0f MB, %.0f ms trigger latency\n", worst.fps, worst.rss_mb, worst.latency_ms);
+        return passed ? 0 : 1;
+    }
+
+    printf("%s\n", passed ? "PASSED" : "FAILED");
+    return passed ? 0 : 1;
+}
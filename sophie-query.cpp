@@ -0,0 +1,83 @@
+//
+//  sophie-query.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+// Lists recorded events from the per-day indexes sophie writes, without touching the recordings themselves.
+
+#include "event_index.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+// Accepts YYYY-MM-DD, YYYY-MM-DDTHH:MM:SS (local time), or @<seconds since the epoch>.
+static bool parse_time(const char *const string, time_t *const time_out) {
+    if (string[0] == '@') {
+        char *end;
+        *time_out = (time_t)strtoll(string + 1, &end, 10);
+        return *end == '\0';
+    }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof (tm));
+
+    const char *end = strptime(string, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (end == NULL) {
+        memset(&tm, 0, sizeof (tm));
+        end = strptime(string, "%Y-%m-%d", &tm);
+    }
+
+    if (end == NULL || *end != '\0') {
+        return false;
+    }
+
+    tm.tm_isdst = -1;
+    *time_out = mktime(&tm);
+    return true;
+}
+
+int main(int argc, const char *argv[]) {
+    time_t from, to;
+
+    if (argc < 4 || argc > 5 || !parse_time(argv[2], &from) || !parse_time(argv[3], &to)) {
+        fprintf(stderr, "usage:\n\tsophie-query <output directory> <from> <to> [<minimum peak pixels different>]\n");
+        fprintf(stderr, "times are YYYY-MM-DD, YYYY-MM-DDTHH:MM:SS, or @<epoch seconds>\n");
+        exit(1);
+    }
+
+    const std::string output_dir = argv[1];
+    const uint32_t min_score = (argc > 4) ? (uint32_t)strtoul(argv[4], NULL, 10) : 0;
+
+    // Walk day by day (through mktime(), so DST changes don't skip or repeat a day), binary-searching each day's index for the start of the range.
+    struct tm day = *localtime(&from);
+    day.tm_hour = 0;
+    day.tm_min = 0;
+    day.tm_sec = 0;
+    day.tm_isdst = -1;
+
+    for (time_t day_start = mktime(&day); day_start <= to; day.tm_mday++, day.tm_isdst = -1, day_start = mktime(&day)) {
+        const std::string datestamp = datestamp_string(day_start);
+        const EventIndexReader reader(output_dir + "/" + datestamp + "/" + EVENT_INDEX_FILENAME);
+        const EventRecord *const records = reader.records();
+        const size_t count = reader.count();
+
+        for (size_t i = reader.lower_bound(from); i < count && records[i].wallclock <= to; i++) {
+            const EventRecord &record = records[i];
+
+            if (record.peak_pixels_different < min_score) {
+                continue;
+            }
+
+            const double duration = (record.end_pts - record.start_pts) * (double)record.time_base_num / record.time_base_den;
+
+            printf("%s\t%.1fs\tpeak %u\t%u interesting\t%s\t%s\n", timestamp_string(record.wallclock).c_str(), duration, record.peak_pixels_different, record.interesting_frame_count, record.video_path, record.image_path);
+        }
+    }
+
+    return 0;
+}
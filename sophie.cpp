@@ -24,12 +24,25 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
+#include <libavutil/time.h>
 }
 
+#include "audio_level.h"
+#include "config.h"
+#include "detector.h"
+#include "event_index.h"
+#include "frame_export.h"
 #include "input.h"
+#include "live_server.h"
+#include "log.h"
 #include "output.h"
+#include "preview.h"
+#include "segmenter.h"
+#include "trace.h"
 #include "util.h"
+#include "yuv.h"
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <signal.h>
 #include <stdint.h>
@@ -37,6 +50,7 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <algorithm>
 #include <filesystem>
 #include <optional>
 #include <string>
@@ -48,15 +62,66 @@ extern "C" {
 
 #define PIXEL_DIFFERENCE_THRESHOLD 40
 #define DIFFERENT_PIXELS_COUNT_THRESHOLD 30
+#define BLOCK_CHANGED_PIXELS_THRESHOLD 3
+#define MIN_REGION_PIXELS 30
+#define VOTE_COUNT 3
+#define VOTE_WINDOW 10
 #define AFTER_MOTION_RECORD_SECONDS 10
 
+// Compiled-in defaults.  Any of these can be overridden by a config file (-c; see sophie.conf.example), which is re-read on SIGHUP.
+
+// Exclude the clock, our neighbors, and the birds from interest.
+#define STRIKE_ZONE_MIN_X 0
+#define STRIKE_ZONE_MAX_X 460
+#define STRIKE_ZONE_MIN_Y 25
+#define STRIKE_ZONE_MAX_Y 480
+
+// Optionally, loud sound also starts a recording: AUDIO_TRIGGER_VOTE_COUNT of the last AUDIO_TRIGGER_VOTE_WINDOW audio frames at AUDIO_TRIGGER_RMS_DBFS or louder.
+#define AUDIO_TRIGGER_ENABLED 0
+#define AUDIO_TRIGGER_RMS_DBFS -20.0f
+#define AUDIO_TRIGGER_VOTE_COUNT 3
+#define AUDIO_TRIGGER_VOTE_WINDOW 10
+
+// Write fragmented MP4, which is readable while recording and survives being killed mid-event.  Fragmented recordings are written in place rather than staged in /tmp.
+#define FRAGMENTED_OUTPUT 1
+
+// Also write the detector's block grid at the trigger as <timestamp>-grid.png, for tuning the strike zone and thresholds.
+#define GRID_SNAPSHOT_ENABLED 0
+
+// NVR-style mode: stream-copy everything into segments (see segmenter.cpp) and only index motion, rather than encoding recordings around triggers.
+#define CONTINUOUS_RECORDING 0
+
+// Serve the camera's stream, as received, to local viewers on a Unix domain socket (see live_server.cpp).  LIVE_VIEW_FORMAT is "mpegts" or "mp4" (fragmented).
+#define LIVE_VIEW_ENABLED 0
+#define LIVE_VIEW_SOCKET_PATH "/tmp/sophie-live.sock"
+#define LIVE_VIEW_FORMAT "mpegts"
+
+// Publish decoded frames with their motion scores to external analyzers through shared memory (see frame_export.h).  Only candidate frames (any pixels over threshold, or during an event) are published.
+#define FRAME_EXPORT_ENABLED 0
+#define FRAME_EXPORT_SOCKET_PATH "/tmp/sophie-frames.sock"
+#define FRAME_EXPORT_SLOT_COUNT 16
+#define FRAME_EXPORT_FULL_YUV 0
+
+// Bounds for the encoder governor (see output.cpp), which keeps recordings encoding in real time.
+#define ENCODER_FASTEST_PRESET "ultrafast"
+#define ENCODER_SLOWEST_PRESET "veryfast"
+#define ENCODER_MIN_CRF 20
+#define ENCODER_MAX_CRF 30
+
+// Per-frame scores are logged at info; histograms of pixel differences at debug (see log.h).
+#define LOG_LEVEL LOG_INFO
+
+// Frames (video and audio) kept to be written ahead of the trigger.
 // TODO: size this more scientifically somehow?  Could maybe have an AVFrame-specific ring buffer that keeps constant time or memory (or min time, max memory).
-RingBuffer<AVFrame *, 1300> frame_buffer([](AVFrame *&frame) {
+#define PRE_ROLL_FRAMES 1300
+
+// Seconds of video between thumbnails on an event's preview sheet (see preview.h).
+#define EVENT_PREVIEW_INTERVAL_SECONDS 1.0
+
+RingBuffer<AVFrame *, MAX_PRE_ROLL_FRAMES> frame_buffer([](AVFrame *&frame) {
     av_frame_free(&frame);
 });
 
-RingBuffer<bool, 10> interesting_frames;
-
 #if defined(__ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__)
 void dump_picture_gray8(const uint8_t *const bytes, const unsigned int width, const unsigned int height, const unsigned int rowbytes, const std::string filename) {
     const CFDataRef data = CFDataCreate(kCFAllocatorDefault, bytes, height * rowbytes);
@@ -159,11 +224,11 @@ void dump_frame(AVFrame *const frame, const std::string filename) {
     const int width = frame->width;
     const int height = frame->height;
     const int bgra_rowbytes = width * 4 * sizeof (uint8_t);
+    TRACE_SPAN("dump_frame");
     uint8_t *const bgra_buffer = (uint8_t *)malloc(height * bgra_rowbytes);
 
-    struct SwsContext *convert_ctx = sws_getContext(width, height, (enum AVPixelFormat)frame->format, width, height, AV_PIX_FMT_BGRA, 0, NULL, NULL, NULL);
-    // TODO: assuming ITU-R BT.709 encoding, AVCOL_RANGE_MPEG (0)
-    sws_setColorspaceDetails(convert_ctx, sws_getCoefficients(SWS_CS_ITU709), 0, sws_getCoefficients(SWS_CS_DEFAULT), 0, 0, 1 << 16, 1 << 16);
+    struct SwsContext *convert_ctx = sws_getContext(width, height, sws_format_for_frame(frame), width, height, AV_PIX_FMT_BGRA, 0, NULL, NULL, NULL);
+    set_sws_colorspace_for_frame(convert_ctx, frame);
     sws_scale(convert_ctx, frame->data, frame->linesize, 0, height, &bgra_buffer, &bgra_rowbytes);
     sws_freeContext(convert_ctx);
 
@@ -171,43 +236,49 @@ void dump_frame(AVFrame *const frame, const std::string filename) {
     free(bgra_buffer);
 }
 
-// TODO: vector-optimize
-Histogram<10> frame_difference_yuv(AVFrame *const frame1, AVFrame *const frame2, uint8_t *const difference_buffer) {
-    assert(frame1->format == AV_PIX_FMT_YUV420P);
-    assert(frame2->format == AV_PIX_FMT_YUV420P);
-    assert(frame1->width  == frame2->width);
-    assert(frame1->height == frame2->height);
-    const int width = frame1->width;
-    const int height = frame1->height;
+void finish_preview(EventPreview *&preview, const std::string event_basename) {
+    if (preview == NULL) {
+        return;
+    }
 
-    Histogram<10> histogram;
+    if (!preview->is_empty()) {
+        TRACE_SPAN("preview");
+        dump_picture_bgra(preview->bytes(), preview->width(), preview->height(), preview->rowbytes(), event_basename + "-preview.png");
+    }
 
-    // Exclude the clock, our neighbors, and the birds from interest.
-#define STRIKE_ZONE_MIN_X 0
-#define STRIKE_ZONE_MAX_X 460
-#define STRIKE_ZONE_MIN_Y 25
-#define STRIKE_ZONE_MAX_Y 480
+    delete preview;
+    preview = NULL;
+}
 
-    for (int y = STRIKE_ZONE_MIN_Y; y < STRIKE_ZONE_MAX_Y; y++) {
-        const uint8_t *const row1 = frame1->data[0] + y * frame1->linesize[0];
-        const uint8_t *const row2 = frame2->data[0] + y * frame2->linesize[0];
-        uint8_t *const diffrow = difference_buffer ? (difference_buffer + y * width) : NULL;
+template <typename Format>
+void brand_frame_chroma(AVFrame *const frame) {
+    typedef typename Format::Sample Sample;
+    const int width = frame->width;
+    const Sample u_value = Format::from_8bit(0);
+    const Sample v_value = Format::from_8bit(255);
 
-        for (int x = STRIKE_ZONE_MIN_X; x < STRIKE_ZONE_MAX_X; x++) {
-            const uint8_t *const pixel1 = row1 + x;
-            const uint8_t *const pixel2 = row2 + x;
-            uint8_t *const diffpixel = diffrow ? (diffrow + x) : NULL;
+    for (int y = 10; y < 35; y++) {
+        const int row_index = y / 2;
 
-            const uint8_t difference = (*pixel1 > *pixel2) ? (*pixel1 - *pixel2) : (*pixel2 - *pixel1);
-            histogram.increment(difference);
+        for (int x = width - 35; x < width - 10; x++) {
+            const int sample_index = x / 2;
 
-            if (diffpixel) {
-                *diffpixel = difference;
+            switch (Format::chroma_layout) {
+                case ChromaLayout::planar:
+                    Format::mutable_row(frame, 1, row_index)[sample_index] = u_value;
+                    Format::mutable_row(frame, 2, row_index)[sample_index] = v_value;
+                    break;
+                case ChromaLayout::interleaved_uv:
+                    Format::mutable_row(frame, 1, row_index)[2 * sample_index] = u_value;
+                    Format::mutable_row(frame, 1, row_index)[2 * sample_index + 1] = v_value;
+                    break;
+                case ChromaLayout::interleaved_vu:
+                    Format::mutable_row(frame, 1, row_index)[2 * sample_index] = v_value;
+                    Format::mutable_row(frame, 1, row_index)[2 * sample_index + 1] = u_value;
+                    break;
             }
         }
     }
-
-    return histogram;
 }
 
 void brand_frame(AVFrame *const frame) {
@@ -219,25 +290,10 @@ void brand_frame(AVFrame *const frame) {
 
     assert(width > 2 * padding + box_side);
     assert(height > 2 * padding + box_side);
-    assert(frame->format == AV_PIX_FMT_YUV420P);
-
-    const int linesize_u = frame->linesize[1];
-    const int linesize_v = frame->linesize[2];
-
-    for (int y = 10; y < 35; y++) {
-        const int row_index = y / 2;
-        uint8_t *const urow = (uint8_t *)(frame->data[1] + row_index * linesize_u);
-        uint8_t *const vrow = (uint8_t *)(frame->data[2] + row_index * linesize_v);
 
-        for (int x = width - 35; x < width - 10; x++) {
-            const int sample_index = x / 2;
-            uint8_t *const u = urow + sample_index;
-            uint8_t *const v = vrow + sample_index;
-
-            *u = 0;
-            *v = 255;
-        }
-    }
+    dispatch_yuv420(frame->format, [&](const auto format) {
+        brand_frame_chroma<decltype(format)>(frame);
+    });
 }
 
 void spawn_notifier(const std::string program, const std::string image_filename) {
@@ -269,47 +325,254 @@ void handle_usr1(int signal) {
     manual_trigger = true;
 }
 
+bool reload_requested = false;
+void handle_hup(int signal) {
+    reload_requested = true;
+}
+
+bool trace_requested = false;
+void handle_usr2(int signal) {
+    trace_requested = true;
+}
+
 int64_t div_i64_rat(int64_t a, AVRational b) {
     return a * b.den / b.num;
 }
 
+Config default_config() {
+    Config config;
+
+    config.detector.strike_zone_min_x = STRIKE_ZONE_MIN_X;
+    config.detector.strike_zone_max_x = STRIKE_ZONE_MAX_X;
+    config.detector.strike_zone_min_y = STRIKE_ZONE_MIN_Y;
+    config.detector.strike_zone_max_y = STRIKE_ZONE_MAX_Y;
+    config.detector.pixel_difference_threshold = PIXEL_DIFFERENCE_THRESHOLD;
+    config.detector.different_pixels_count_threshold = DIFFERENT_PIXELS_COUNT_THRESHOLD;
+    config.detector.block_changed_pixels_threshold = BLOCK_CHANGED_PIXELS_THRESHOLD;
+    config.detector.min_region_pixels = MIN_REGION_PIXELS;
+    config.detector.vote_count = VOTE_COUNT;
+    config.detector.vote_window = VOTE_WINDOW;
+    config.after_motion_record_seconds = AFTER_MOTION_RECORD_SECONDS;
+    config.pre_roll_frames = PRE_ROLL_FRAMES;
+    config.log_level = LOG_LEVEL;
+
+    config.audio_trigger_enabled = AUDIO_TRIGGER_ENABLED;
+    config.audio_trigger_rms_dbfs = AUDIO_TRIGGER_RMS_DBFS;
+    config.audio_trigger_vote_count = AUDIO_TRIGGER_VOTE_COUNT;
+    config.audio_trigger_vote_window = AUDIO_TRIGGER_VOTE_WINDOW;
+
+    config.encoder_fastest_preset = ENCODER_FASTEST_PRESET;
+    config.encoder_slowest_preset = ENCODER_SLOWEST_PRESET;
+    config.encoder_min_crf = ENCODER_MIN_CRF;
+    config.encoder_max_crf = ENCODER_MAX_CRF;
+    config.fragmented_output = FRAGMENTED_OUTPUT;
+    config.grid_snapshot_enabled = GRID_SNAPSHOT_ENABLED;
+
+    config.continuous_recording = CONTINUOUS_RECORDING;
+    config.live_view_enabled = LIVE_VIEW_ENABLED;
+    config.live_view_socket_path = LIVE_VIEW_SOCKET_PATH;
+    config.live_view_format = LIVE_VIEW_FORMAT;
+    config.frame_export_enabled = FRAME_EXPORT_ENABLED;
+    config.frame_export_socket_path = FRAME_EXPORT_SOCKET_PATH;
+    config.frame_export_slot_count = FRAME_EXPORT_SLOT_COUNT;
+    config.frame_export_full_yuv = FRAME_EXPORT_FULL_YUV;
+
+    return config;
+}
+
+// With -s, a summary of the run is written on exit, one `key value` per line (see sophie-perftest.cpp).
+struct RunStats {
+    int64_t first_frame_time = 0;
+    unsigned int recordings = 0;
+
+    // From the frame that triggered a recording to that recording's first packet reaching the muxer.
+    int64_t max_trigger_latency = 0;
+
+    void recording_finished(const Output *const output, const int64_t trigger_time) {
+        recordings++;
+
+        if (output->first_write_time() != 0) {
+            max_trigger_latency = std::max(max_trigger_latency, output->first_write_time() - trigger_time);
+        }
+    }
+
+    void write(const std::string filename, const unsigned int video_frames) const {
+        FILE *const file = fopen(filename.c_str(), "w");
+
+        if (file == NULL) {
+            LOG(LOG_WARNING, "couldn't open stats file %s: %s", filename.c_str(), strerror(errno));
+            return;
+        }
+
+        const double seconds = (first_frame_time != 0) ? (av_gettime_relative() - first_frame_time) / 1000000.0 : 0;
+        fprintf(file, "video_frames %u\n", video_frames);
+        fprintf(file, "seconds %.3f\n", seconds);
+        fprintf(file, "fps %.1f\n", (seconds > 0) ? video_frames / seconds : 0);
+        fprintf(file, "recordings %u\n", recordings);
+        fprintf(file, "max_trigger_latency_ms %.1f\n", max_trigger_latency / 1000.0);
+        fclose(file);
+    }
+};
+
+void usage() {
+    fprintf(stderr, "usage:\n\tsophie [-c <config file>] [-s <stats file>] <input specifier> <output directory> [<notifier program>]\n");
+    exit(1);
+}
+
 int main(int argc, const char *argv[]) {
-    if (argc < 3 || argc > 4) {
-        fprintf(stderr, "usage:\n\tsophie <input specifier> <output directory> [<notifier program>]\n");
+    std::optional<std::string> config_filename;
+    std::optional<std::string> stats_filename;
+    int ch;
+
+    while ((ch = getopt(argc, (char *const *)argv, "c:s:")) != -1) {
+        switch (ch) {
+            case 'c':
+                config_filename = std::string(optarg);
+                break;
+            case 's':
+                stats_filename = std::string(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2 || argc > 3) {
+        usage();
+    }
+
+    Config config = default_config();
+
+    if (config_filename && !load_config(*config_filename, config)) {
         exit(1);
     }
 
+    log_start(config.log_level);
+
     av_log_set_level(AV_LOG_WARNING); // TODO: this also blocks the dump input/output.  Can I get that back?
     signal(SIGUSR1, handle_usr1);
     signal(SIGCHLD, handle_chld);
+    signal(SIGUSR2, handle_usr2);
+    signal(SIGHUP, handle_hup);
+    trace_init();
 
-    const std::string input_filename = argv[1];
-    const std::string output_dir = argv[2];
-    const std::optional<std::string> notifier_program = (argc > 3) ? std::string(argv[3]) : std::optional<std::string>();
+    // Live view clients may disconnect at any time; find out from write() rather than dying.
+    signal(SIGPIPE, SIG_IGN);
+
+    const std::string input_filename = argv[0];
+    const std::string output_dir = argv[1];
+    const std::optional<std::string> notifier_program = (argc > 2) ? std::string(argv[2]) : std::optional<std::string>();
 
     Input input(input_filename);
     Output *output = NULL;
     int64_t last_motion_timestamp = 0;
     AVFrame *const previous_video_frame = av_frame_alloc();
-    uint8_t *difference_buffer = NULL;
     int video_frame_total_index = 0;
-    std::string temp_filename, destination_filename;
+    bool in_event = false;
+    std::string event_basename, temp_filename, destination_filename;
+    int64_t trigger_time = 0;
+    EventPreview *preview = NULL;
+    RunStats stats;
+
+    Segmenter *segmenter = NULL;
+    MotionIndex motion_index(output_dir);
+    EventIndex event_index(output_dir);
+    EventRecord event_record;
+    EncoderGovernor governor(config.encoder_fastest_preset, config.encoder_slowest_preset, config.encoder_min_crf, config.encoder_max_crf);
+
+    // See detector.h for the three stages.
+    DetectorChain detector(config.detector);
+    detector.add_scorer(std::make_unique<LumaDifferenceScorer>());
+    detector.add_threshold(std::make_unique<PixelCountThreshold>());
+    detector.add_threshold(std::make_unique<RegionThreshold>());
+    detector.add_voter(std::make_unique<KOfNVoter>(config.detector));
+
+    AudioTrigger audio_trigger(config.audio_trigger_rms_dbfs, config.audio_trigger_vote_count, config.audio_trigger_vote_window);
+    bool audio_triggered = false;
+
+    if (config.continuous_recording) {
+        segmenter = input.create_segmenter(output_dir);
+        input.add_packet_sink(segmenter);
+    }
+
+    LiveServer *live_server = NULL;
+
+    if (config.live_view_enabled) {
+        live_server = input.create_live_server(config.live_view_socket_path, config.live_view_format);
+        input.add_packet_sink(live_server);
+    }
+
+    FrameExport *frame_export = NULL;
+
+    if (config.frame_export_enabled) {
+        frame_export = new FrameExport(config.frame_export_socket_path, config.frame_export_slot_count, config.frame_export_full_yuv);
+    }
 
     for (;;) {
+        if (trace_requested) {
+            trace_write_async();
+            trace_requested = false;
+        }
+
+        // Re-read the config between frames.  The input, buffered frames and any recording in progress carry on untouched.
+        if (reload_requested) {
+            reload_requested = false;
+            Config new_config = default_config();
+
+            if (!config_filename) {
+                LOG(LOG_WARNING, "no config file to reload (see -c)");
+            } else if (load_config(*config_filename, new_config)) {
+                keep_startup_only_settings(config, new_config);
+                config = new_config;
+
+                detector.set_parameters(config.detector);
+                audio_trigger.set_parameters(config.audio_trigger_rms_dbfs, config.audio_trigger_vote_count, config.audio_trigger_vote_window);
+                governor.set_bounds(config.encoder_fastest_preset, config.encoder_slowest_preset, config.encoder_min_crf, config.encoder_max_crf);
+                log_set_level(config.log_level);
+
+                while (frame_buffer.count() > config.pre_roll_frames) {
+                    frame_buffer.drop_first();
+                }
+
+                LOG(LOG_INFO, "reloaded %s", config_filename->c_str());
+            } else {
+                LOG(LOG_WARNING, "keeping previous configuration");
+            }
+        }
+
         bool is_audio;
         AVFrame *const frame = input.get_next_frame(&is_audio);
 
         static bool got_first_frame;
         if (!got_first_frame) {
-            fprintf(stderr, "sophie on guard dog duty!\n");
+            LOG(LOG_INFO, "sophie on guard dog duty!");
+            stats.first_frame_time = av_gettime_relative();
             got_first_frame = true;
         }
 
         if (frame == NULL) {
-            fprintf(stderr, "no frame\n");
+            LOG(LOG_INFO, "no frame");
             break;
         }
 
+        // Start motion detection afresh after a dropped stream.
+        if (input.reconnected()) {
+            av_frame_unref(previous_video_frame);
+        }
+
+        // Listen for noise.  This only latches the trigger; the recording state machine below runs on video frames.
+        if (is_audio && config.audio_trigger_enabled) {
+            AudioLevel level;
+
+            if (audio_trigger.process(frame, &level) && !audio_triggered) {
+                LOG(LOG_INFO, "audio trigger: rms %.1f dBFS, peak %.1f dBFS", level_to_dbfs(level.rms), level_to_dbfs(level.peak));
+                audio_triggered = true;
+            }
+        }
+
         // Detect motion.
         if (!is_audio) {
             // Delete some stuff from the frame to avoid affecting output encoding.  Seems like this state shouldn't really be on AVFrame itself.
@@ -317,30 +580,27 @@ int main(int argc, const char *argv[]) {
             frame->pict_type = AV_PICTURE_TYPE_NONE;
 
             if (previous_video_frame->data[0] != NULL) {
-                if (difference_buffer == NULL) {
-                    const size_t size = frame->width * frame->height * sizeof (uint8_t);
-                    difference_buffer = (uint8_t *)malloc(size);
-                    memset(difference_buffer, 0, size);
+                FrameScore score;
+                const DetectorResult result = detector.process(previous_video_frame, frame, score);
+                const uint32_t pixels_different = score.pixels_different;
+                const bool frame_interesting = result.frame_interesting;
+
+                if (pixels_different > 0 || score.recent_interesting_frames > 0) {
+                    LOG_WITH(LOG_INFO, log_frame, video_frame_total_index, pixels_different, score.region.blocks, score.region.pixels, frame_interesting);
+                    LOG_RATE_LIMITED_WITH(LOG_DEBUG, 10, log_histogram, *score.histogram);
+#if VERBOSE
+                    fprintf(stderr, "%s", score.grid->description(detector.parameters().block_changed_pixels_threshold).c_str());
+#endif /* VERBOSE */
                 }
 
-                // Filter 1: pixels are only counted as different if they change by PIXEL_DIFFERENCE_THRESHOLD, to discard sensor noise.
-                const Histogram<10> histogram = frame_difference_yuv(previous_video_frame, frame, difference_buffer);
-                const uint32_t pixels_different = histogram.count_where([](const uint8_t value) {
-                    return value >= PIXEL_DIFFERENCE_THRESHOLD;
-                });
-
-                // Filter 2: frames are only counted as interesting if DIFFERENT_PIXELS_COUNT_THRESHOLD pixels are different, to discard small differences like leaves in the wind and birds.
-                const bool frame_interesting = pixels_different >= DIFFERENT_PIXELS_COUNT_THRESHOLD;
-
-                // Filter 3: output is only generated if 3 out of the last 10 frames are different, to discard transient dazzle.
-                interesting_frames.append(frame_interesting);
-                const size_t interesting_count = interesting_frames.count_where([](const bool &value) {
-                    return value == true;
-                });
-
-                if (pixels_different > 0 || interesting_count > 0) {
-                    fprintf(stderr, "%d: %d%s\n", video_frame_total_index, pixels_different, frame_interesting ? " ***" : "");
-                    fprintf(stderr, "%s\n", histogram.description().c_str());
+                // Export before branding, so analyzers see the frame as decoded.
+                if (frame_export != NULL && (pixels_different > 0 || in_event)) {
+                    TRACE_SPAN("frame_export");
+                    if (!frame_export->publish(frame, input.video_frame_time_base(), pixels_different, score.region.pixels, frame_interesting)) {
+                        LOG(LOG_WARNING, "frame export disabled");
+                        delete frame_export;
+                        frame_export = NULL;
+                    }
                 }
 
                 // As a debugging technique, brand interesting frames with a red box in the upper-right corner.  The branding doesn't affect the Y channel.
@@ -348,44 +608,90 @@ int main(int argc, const char *argv[]) {
                     brand_frame(frame);
                 }
 
-                if (interesting_count >= 3 || manual_trigger) {
-                    if (output == NULL) {
-                        char string_buffer[1024];
+                if (in_event) {
+                    event_record.end_pts = frame->pts;
+                    event_record.peak_pixels_different = std::max(event_record.peak_pixels_different, pixels_different);
+                    event_record.interesting_frame_count += frame_interesting ? 1 : 0;
+                }
+
+                if (result.triggered || manual_trigger || audio_triggered) {
+                    if (!in_event) {
+                        trigger_time = av_gettime_relative();
                         const time_t t = time(NULL);
-                        const struct tm *const lt = localtime(&t);
-                        strftime(string_buffer, sizeof (string_buffer), "%Y-%m-%d", lt);
-                        const std::string datestamp_string = std::string(string_buffer);
-                        strftime(string_buffer, sizeof (string_buffer), "%Y-%m-%dT%H:%M:%S%z", lt);
-                        const std::string timestamp_string = std::string(string_buffer);
+                        const std::string datestamp = datestamp_string(t);
+                        const std::string timestamp = timestamp_string(t);
 
-                        const std::string date_output_dir = output_dir + "/" + datestamp_string;
+                        const std::string date_output_dir = output_dir + "/" + datestamp;
+                        const std::string relative_basename = datestamp + "/" + timestamp;
                         std::filesystem::create_directory(date_output_dir);
 
 #if 0
-                        dump_picture_gray8(difference_buffer, frame->width, frame->height, frame->width, date_output_dir + "/" + timestamp_string + "-difference.png");
+                        dump_picture_gray8(score.difference_buffer, frame->width, frame->height, frame->width, date_output_dir + "/" + timestamp + "-difference.png");
 #endif /* 0 */
-                        const std::string image_filename = date_output_dir + "/" + timestamp_string + ".png";
+                        if (config.grid_snapshot_enabled) {
+                            const std::vector<uint8_t> grid_image = score.grid->image();
+                            dump_picture_gray8(grid_image.data(), score.grid->columns(), score.grid->rows(), score.grid->columns(), date_output_dir + "/" + timestamp + "-grid.png");
+                        }
+                        event_basename = output_dir + "/" + relative_basename;
+                        const std::string image_filename = event_basename + ".png";
                         dump_frame(frame, image_filename);
 
                         if (notifier_program) {
                             spawn_notifier(*notifier_program, image_filename);
                         }
 
-                        char path[] = "/tmp/sophie.mp4.XXXXXX";
-                        const int fd = mkstemp(path);
-                        assert(fd != -1);
-                        int rv = fchmod(fd, 0644);
-                        assert(rv == 0);
-                        temp_filename = std::string(path);
+                        const AVRational time_base = input.video_frame_time_base();
+                        memset(&event_record, 0, sizeof (event_record));
+                        event_record.wallclock = t;
+                        event_record.start_pts = frame->pts;
+                        event_record.end_pts = frame->pts;
+                        event_record.time_base_num = time_base.num;
+                        event_record.time_base_den = time_base.den;
+                        event_record.peak_pixels_different = pixels_different;
+                        event_record.interesting_frame_count = frame_interesting ? 1 : 0;
+                        snprintf(event_record.image_path, sizeof (event_record.image_path), "%s", (relative_basename + ".png").c_str());
+                        preview = new EventPreview(time_base, EVENT_PREVIEW_INTERVAL_SECONDS);
+
+                        if (segmenter == NULL) {
+                            snprintf(event_record.video_path, sizeof (event_record.video_path), "%s", (relative_basename + ".mp4").c_str());
+                        }
+
+                        in_event = true;
+                    }
+
+                    if (segmenter != NULL) {
+                        // Continuous mode: the segments already have the video; just note where the motion is.
+                        std::string segment_filename;
+                        double offset_seconds;
+
+                        if (segmenter->locate(frame->pts, &segment_filename, &offset_seconds)) {
+                            motion_index.append(segment_filename, offset_seconds, pixels_different);
 
-                        destination_filename = date_output_dir + "/" + timestamp_string + ".mp4";
+                            if (event_record.video_path[0] == '\0') {
+                                snprintf(event_record.video_path, sizeof (event_record.video_path), "%s", segment_filename.c_str());
+                            }
+                        }
+                    } else if (output == NULL) {
+                        destination_filename = event_basename + ".mp4";
+
+                        if (config.fragmented_output) {
+                            temp_filename = destination_filename;
+                        } else {
+                            char path[] = "/tmp/sophie.mp4.XXXXXX";
+                            const int fd = mkstemp(path);
+                            assert(fd != -1);
+                            int rv = fchmod(fd, 0644);
+                            assert(rv == 0);
+                            temp_filename = std::string(path);
+                        }
 
-                        fprintf(stderr, "%d: starting recording%s to %s\n", video_frame_total_index, manual_trigger ? " (manual)" : "", temp_filename.c_str());
+                        LOG(LOG_INFO, "%d: starting recording%s to %s", video_frame_total_index, manual_trigger ? " (manual)" : (audio_triggered && !result.triggered) ? " (audio)" : "", temp_filename.c_str());
 
-                        output = input.create_output(temp_filename);
+                        output = input.create_output(temp_filename, config.fragmented_output, &governor);
 
                         // Output our buffered frames first.
                         // TODO: when frame_buffer is large, this loop can take quite a while (many seconds on the machine I'm using) and can cause the outer loop to miss frames.
+                        TRACE_SPAN("pre-roll");
                         bool encoded_video = false;
                         for (AVFrame *const frame : frame_buffer) {
                             const bool is_audio = frame_is_audio(frame);
@@ -397,24 +703,46 @@ int main(int argc, const char *argv[]) {
                                 fprintf(stderr, "outputting back frame %p\n", frame);
 #endif /* VERBOSE */
                                 output->encode_frame(frame, is_audio);
+
+                                if (!is_audio) {
+                                    preview->add_frame(frame);
+                                }
                             }
                         }
                     }
 
                     manual_trigger = false;
+                    audio_triggered = false;
                     last_motion_timestamp = frame->pts;
-                } else if (output != NULL && frame->pts >= last_motion_timestamp + div_i64_rat(AFTER_MOTION_RECORD_SECONDS, input.video_frame_time_base())) {
-                    fprintf(stderr, "%d: ending recording; moving to %s\n", video_frame_total_index, destination_filename.c_str());
-                    output->finish();
+                } else if (in_event && frame->pts >= last_motion_timestamp + div_i64_rat(config.after_motion_record_seconds, input.video_frame_time_base())) {
+                    if (output != NULL) {
+                        LOG(LOG_INFO, "%d: ending recording; moving to %s", video_frame_total_index, destination_filename.c_str());
+                        output->finish();
+                        stats.recording_finished(output, trigger_time);
+
+                        if (temp_filename != destination_filename) {
+                            TRACE_SPAN("move_file");
+                            move_file(temp_filename, destination_filename);
+                        }
+
+                        temp_filename.clear();
+                        destination_filename.clear();
 
-                    move_file(temp_filename, destination_filename);
-                    temp_filename.clear();
-                    destination_filename.clear();
+                        delete output;
+                        output = NULL;
+                    } else {
+                        LOG(LOG_INFO, "%d: motion ended", video_frame_total_index);
+                    }
 
-                    delete output;
-                    output = NULL;
+                    finish_preview(preview, event_basename);
+                    event_index.append(event_record);
+                    in_event = false;
                     last_motion_timestamp = 0;
                 }
+
+                if (preview != NULL) {
+                    preview->add_frame(frame);
+                }
             }
 
             video_frame_total_index++;
@@ -422,20 +750,33 @@ int main(int argc, const char *argv[]) {
             av_frame_ref(previous_video_frame, frame);
         }
 
-        // Buffer the frame.
-        frame_buffer.append(frame);
-
         if (output != NULL) {
             output->encode_frame(frame, is_audio);
         }
+
+        // Buffer the frame.  In continuous mode, pre-roll comes from the segments on disk instead.
+        if (segmenter == NULL) {
+            frame_buffer.append(frame);
+
+            if (frame_buffer.count() > config.pre_roll_frames) {
+                frame_buffer.drop_first();
+            }
+        } else {
+            AVFrame *frame_to_free = frame;
+            av_frame_free(&frame_to_free);
+        }
     }
 
     // If the input ends while output is active, end output before exiting.
     if (output != NULL) {
-        fprintf(stderr, "END: ending recording; moving to %s\n", destination_filename.c_str());
+        LOG(LOG_INFO, "END: ending recording; moving to %s", destination_filename.c_str());
         output->finish();
+        stats.recording_finished(output, trigger_time);
+
+        if (temp_filename != destination_filename) {
+            move_file(temp_filename, destination_filename);
+        }
 
-        move_file(temp_filename, destination_filename);
         temp_filename.clear();
         destination_filename.clear();
 
@@ -444,5 +785,33 @@ int main(int argc, const char *argv[]) {
         last_motion_timestamp = 0;
     }
 
+    if (in_event) {
+        finish_preview(preview, event_basename);
+        event_index.append(event_record);
+        in_event = false;
+    }
+
+    if (segmenter != NULL) {
+        segmenter->finish();
+        delete segmenter;
+        segmenter = NULL;
+    }
+
+    if (live_server != NULL) {
+        delete live_server;
+        live_server = NULL;
+    }
+
+    if (frame_export != NULL) {
+        delete frame_export;
+        frame_export = NULL;
+    }
+
+    if (stats_filename) {
+        stats.write(*stats_filename, video_frame_total_index);
+    }
+
+    trace_write();
+    log_finish();
     return 0;
 }
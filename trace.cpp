@@ -0,0 +1,285 @@
+//
+//  trace.cpp
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+#include "trace.h"
+#include "log.h"
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Events kept per thread.  Older events are overwritten, so a trace covers roughly the last few minutes of the main loop.
+#define TRACE_BUFFER_EVENTS 16384
+
+// Writers and live-view clients come and go with their own threads.  An exited thread's buffer is reused once trace_write() has written its events, or regardless, past this many buffers.
+#define TRACE_MAX_BUFFERS 64
+
+bool trace_enabled = false;
+
+struct TraceEvent {
+    const char *name;
+    uint64_t begin_us;
+    uint64_t end_us;
+};
+
+// A per-slot sequence lets trace_write() read a ring that its owner is still writing: odd while event n is being written, 2n + 2 once it's complete.
+// The event's fields are relaxed atomics only so that the racing read is well defined; the sequence does the ordering.
+struct TraceSlot {
+    std::atomic<uint64_t> sequence;
+    std::atomic<const char *> name;
+    std::atomic<uint64_t> begin_us;
+    std::atomic<uint64_t> end_us;
+};
+
+struct TraceBuffer : private DeleteImplicit {
+    int tid;
+    std::atomic<const char *> name;
+    std::atomic<bool> retired;
+    bool written;       // retired, and its events since emitted by trace_write()
+
+    // Only the owning thread writes events.  `count` never goes backward, even when the buffer is reused, so a slot's sequence is never repeated.
+    std::atomic<uint64_t> count;
+    uint64_t first;     // the current owner's first event
+    TraceSlot slots[TRACE_BUFFER_EVENTS];
+
+    TraceBuffer(const int tid) : tid(tid), name(NULL), retired(false), written(false), count(0), first(0) {}
+};
+
+static std::string trace_path;
+static std::mutex trace_buffers_mutex;
+static std::vector<TraceBuffer *> trace_buffers;
+static int trace_next_tid = 1;
+
+// Serializes trace_write() and trace_write_async().
+static std::mutex trace_write_mutex;
+static std::thread trace_write_thread;
+static std::atomic<bool> trace_writing(false);
+
+// Marks the thread's buffer as reusable when the thread exits.  Its events stay in the ring until another thread takes it over.
+struct TraceBufferHolder {
+    TraceBuffer *buffer = NULL;
+
+    ~TraceBufferHolder() {
+        if (buffer != NULL) {
+            buffer->retired = true;
+        }
+    }
+};
+
+static thread_local TraceBufferHolder trace_buffer_holder;
+
+static TraceBuffer *trace_buffer() {
+    if (trace_buffer_holder.buffer == NULL) {
+        std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+        TraceBuffer *buffer = NULL;
+
+        // Prefer a buffer whose events have already been written out.  Past TRACE_MAX_BUFFERS, take any retired one, losing its events.
+        for (TraceBuffer *const candidate : trace_buffers) {
+            if (candidate->retired && candidate->written) {
+                buffer = candidate;
+                break;
+            }
+        }
+
+        if (buffer == NULL && trace_buffers.size() >= TRACE_MAX_BUFFERS) {
+            for (TraceBuffer *const candidate : trace_buffers) {
+                if (candidate->retired) {
+                    buffer = candidate;
+                    break;
+                }
+            }
+        }
+
+        if (buffer != NULL) {
+            buffer->tid = trace_next_tid++;
+            buffer->name = NULL;
+            buffer->first = buffer->count.load(std::memory_order_relaxed);
+            buffer->written = false;
+            buffer->retired = false;
+        } else {
+            buffer = new TraceBuffer(trace_next_tid++);
+            trace_buffers.push_back(buffer);
+        }
+
+        trace_buffer_holder.buffer = buffer;
+    }
+
+    return trace_buffer_holder.buffer;
+}
+
+void trace_init() {
+    const char *const path = getenv("SOPHIE_TRACE");
+
+    if (path != NULL && path[0] != '\0') {
+        trace_path = path;
+        trace_enabled = true;
+        trace_set_thread_name("main");
+        LOG(LOG_INFO, "tracing to %s", path);
+    }
+}
+
+void trace_set_thread_name(const char *const name) {
+    if (trace_enabled) {
+        trace_buffer()->name = name;
+    }
+}
+
+uint64_t trace_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_record(const char *const name, const uint64_t begin_us, const uint64_t end_us) {
+    TraceBuffer *const buffer = trace_buffer();
+    const uint64_t n = buffer->count.load(std::memory_order_relaxed);
+    TraceSlot &slot = buffer->slots[n % TRACE_BUFFER_EVENTS];
+
+    slot.sequence.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.begin_us.store(begin_us, std::memory_order_relaxed);
+    slot.end_us.store(end_us, std::memory_order_relaxed);
+    slot.sequence.store(2 * n + 2, std::memory_order_release);
+    buffer->count.store(n + 1, std::memory_order_release);
+}
+
+struct TraceBufferSnapshot {
+    TraceBuffer *buffer;
+    int tid;
+    const char *name;
+    bool retired;
+    uint64_t first;
+    uint64_t count;
+    std::vector<TraceEvent> events;
+};
+
+static void trace_write_file() {
+    // Note which buffers to write under the lock, but copy and format their events outside it, so that threads starting up (and taking the lock in trace_buffer()) aren't held up.
+    // Buffers are never freed, so the pointers stay good.
+    std::vector<TraceBufferSnapshot> snapshots;
+
+    {
+        std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+
+        for (TraceBuffer *const buffer : trace_buffers) {
+            snapshots.push_back({ buffer, buffer->tid, buffer->name, buffer->retired, buffer->first, buffer->count.load(std::memory_order_acquire), {} });
+        }
+    }
+
+    for (TraceBufferSnapshot &snapshot : snapshots) {
+        const uint64_t start = std::max(snapshot.first, (snapshot.count > TRACE_BUFFER_EVENTS) ? snapshot.count - TRACE_BUFFER_EVENTS : 0);
+        snapshot.events.reserve(snapshot.count - start);
+
+        for (uint64_t i = start; i < snapshot.count; i++) {
+            const TraceSlot &slot = snapshot.buffer->slots[i % TRACE_BUFFER_EVENTS];
+
+            // Skip slots the owner has since overwritten (or is overwriting).
+            const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence != 2 * i + 2) {
+                continue;
+            }
+
+            const TraceEvent event = { slot.name.load(std::memory_order_relaxed), slot.begin_us.load(std::memory_order_relaxed), slot.end_us.load(std::memory_order_relaxed) };
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+                snapshot.events.push_back(event);
+            }
+        }
+    }
+
+    {
+        // Retired buffers' events are now out, so the buffers can be reused without losing anything.
+        std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+
+        for (const TraceBufferSnapshot &snapshot : snapshots) {
+            if (snapshot.retired && snapshot.buffer->tid == snapshot.tid) {
+                snapshot.buffer->written = true;
+            }
+        }
+    }
+
+    // Write beside the destination and rename, so a viewer never sees a partial file.
+    const std::string temp_path = trace_path + ".tmp";
+    FILE *const file = fopen(temp_path.c_str(), "w");
+
+    if (file == NULL) {
+        LOG(LOG_WARNING, "couldn't open %s: %s", temp_path.c_str(), strerror(errno));
+        return;
+    }
+
+    const int pid = getpid();
+    bool first = true;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for (const TraceBufferSnapshot &snapshot : snapshots) {
+        if (snapshot.name != NULL) {
+            fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",", pid, snapshot.tid, snapshot.name);
+            first = false;
+        }
+
+        for (const TraceEvent &event : snapshot.events) {
+            fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 "}", first ? "" : ",", event.name, pid, snapshot.tid, event.begin_us, event.end_us - event.begin_us);
+            first = false;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    if (rename(temp_path.c_str(), trace_path.c_str()) != 0) {
+        LOG(LOG_WARNING, "couldn't rename %s to %s: %s", temp_path.c_str(), trace_path.c_str(), strerror(errno));
+        return;
+    }
+
+    LOG(LOG_INFO, "wrote trace to %s", trace_path.c_str());
+}
+
+void trace_write() {
+    if (!trace_enabled) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(trace_write_mutex);
+
+    if (trace_write_thread.joinable()) {
+        trace_write_thread.join();
+    }
+
+    trace_write_file();
+}
+
+void trace_write_async() {
+    if (!trace_enabled || trace_writing) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(trace_write_mutex);
+
+    if (trace_write_thread.joinable()) {
+        trace_write_thread.join();
+    }
+
+    trace_writing = true;
+    trace_write_thread = std::thread([] {
+        trace_set_thread_name("trace writer");
+        trace_write_file();
+        trace_writing = false;
+    });
+}
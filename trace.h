@@ -0,0 +1,47 @@
+//
+//  trace.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+#include "util.h"
+#include <stdint.h>
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// Opt-in timeline tracing.  If SOPHIE_TRACE names a file, spans are recorded into per-thread ring buffers and written there as Chrome trace-event JSON
+// (open with chrome://tracing or ui.perfetto.dev) by trace_write().  When tracing is off, a span costs one predictable branch.
+
+extern bool trace_enabled;
+
+void trace_init();
+void trace_set_thread_name(const char *name);
+uint64_t trace_now_us();
+void trace_record(const char *name, uint64_t begin_us, uint64_t end_us);
+void trace_write();
+
+// Writes the trace on a helper thread, so the caller isn't held up.  Does nothing if a write is already under way.
+void trace_write_async();
+
+// Records the enclosing scope as a span.  `name` must be a string literal (only the pointer is kept).
+struct TraceSpan : private DeleteImplicit {
+    TraceSpan(const char *const name) : _name(name), _begin_us(trace_enabled ? trace_now_us() : 0) {}
+
+    ~TraceSpan() {
+        if (trace_enabled) {
+            trace_record(_name, _begin_us, trace_now_us());
+        }
+    }
+
+private:
+    const char *const _name;
+    const uint64_t _begin_us;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name)
+
+#endif /* TRACE_H */
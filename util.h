@@ -12,9 +12,16 @@ extern "C" {
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
 #include <fstream>
 #include <functional>
 #include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #ifndef UTIL_H
 #define UTIL_H
@@ -43,6 +50,14 @@ struct RingBuffer : private DeleteImplicit {
         _head = (_head == size - 1) ? 0 : (_head + 1);
     }
 
+    // Drops the oldest value, as if it had been overwritten.
+    void drop_first() {
+        assert(!_empty);
+        _drop(_values[_tail]);
+        _tail = (_tail == size - 1) ? 0 : (_tail + 1);
+        _empty = (_tail == _head);
+    }
+
     size_t count() const {
         if (_empty) {
             return 0;
@@ -120,6 +135,120 @@ private:
     bool _empty;
 };
 
+// Sum of the last `length` values appended, for any length up to `capacity`, maintained in O(1) per append.
+// NOTE: intended for integer T; floating-point sums would accumulate rounding error over time.
+template <typename T, size_t capacity>
+struct SlidingWindowSum : private DeleteImplicit {
+    SlidingWindowSum(const size_t length = capacity) {
+        set_length(length);
+    }
+
+    // Changing the length discards the window's contents.
+    void set_length(const size_t length) {
+        assert(length >= 1 && length <= capacity);
+        _length = length;
+        reset();
+    }
+
+    void reset() {
+        _head = 0;
+        _count = 0;
+        _sum = 0;
+    }
+
+    void append(const T value) {
+        if (_count == _length) {
+            _sum -= _values[_head];
+        } else {
+            _count++;
+        }
+
+        _values[_head] = value;
+        _sum += value;
+        _head = (_head == _length - 1) ? 0 : (_head + 1);
+    }
+
+    T sum() const {
+        return _sum;
+    }
+
+    size_t count() const {
+        return _count;
+    }
+
+    size_t length() const {
+        return _length;
+    }
+
+private:
+    T _values[capacity];
+    size_t _length;
+    size_t _head;
+    size_t _count;
+    T _sum;
+};
+
+// How many of the last `length` booleans appended were true, in O(1) per append.
+template <size_t capacity>
+struct SlidingWindowCount : private DeleteImplicit {
+    SlidingWindowCount(const size_t length = capacity) : _window(length) {}
+
+    void set_length(const size_t length) {
+        _window.set_length(length);
+    }
+
+    void reset() {
+        _window.reset();
+    }
+
+    void append(const bool value) {
+        _window.append(value ? 1 : 0);
+    }
+
+    uint32_t count_true() const {
+        return _window.sum();
+    }
+
+    size_t length() const {
+        return _window.length();
+    }
+
+private:
+    SlidingWindowSum<uint32_t, capacity> _window;
+};
+
+// Exponentially-weighted moving average.  The first value appended seeds the average.
+struct EWMA {
+    EWMA(const double alpha) : _alpha(alpha), _value(0), _empty(true) {}
+
+    void set_alpha(const double alpha) {
+        _alpha = alpha;
+    }
+
+    void reset() {
+        _value = 0;
+        _empty = true;
+    }
+
+    void append(const double value) {
+        _value = _empty ? value : (_value + _alpha * (value - _value));
+        _empty = false;
+    }
+
+    double value() const {
+        return _value;
+    }
+
+    bool is_empty() const {
+        return _empty;
+    }
+
+private:
+    double _alpha;
+    double _value;
+    bool _empty;
+};
+
 template <unsigned int bucket_size>
 struct Histogram : private DeleteImplicit {
     Histogram() : _buckets{0} {}
@@ -133,6 +262,12 @@ struct Histogram : private DeleteImplicit {
         _buckets[value / bucket_size]++;
     }
 
+    void reset() {
+        for (int i = 0; i < 256; i++) {
+            _buckets[i] = 0;
+        }
+    }
+
     std::string description() const {
         std::string description = "";
 
@@ -145,6 +280,14 @@ struct Histogram : private DeleteImplicit {
         return description;
     }
 
+    // Buckets that can hold any values at all.
+    static constexpr unsigned int bucket_count = 255 / bucket_size + 1;
+
+    uint32_t bucket(const unsigned int index) const {
+        assert(index < bucket_count);
+        return _buckets[index];
+    }
+
     uint32_t count_where(const std::function<bool(uint8_t)> predicate) const {
         uint32_t count = 0;
 
@@ -160,6 +303,120 @@ private:
     uint32_t _buckets[256];
 };
 
+// Counts changed pixels per block_size x block_size block of a frame, so that compact changes (an object) can be told apart from the same number of changed pixels scattered across the frame (noise).
+template <unsigned int block_size>
+struct BlockGrid : private DeleteImplicit {
+    struct Region {
+        unsigned int blocks;
+        uint32_t pixels;
+    };
+
+    BlockGrid() : _columns(0), _rows(0) {}
+
+    void reset(const unsigned int width, const unsigned int height) {
+        _columns = (width + block_size - 1) / block_size;
+        _rows = (height + block_size - 1) / block_size;
+        _counts.assign(_columns * _rows, 0);
+    }
+
+    void increment(const unsigned int x, const unsigned int y) {
+        _counts[(y / block_size) * _columns + (x / block_size)]++;
+    }
+
+    unsigned int columns() const {
+        return _columns;
+    }
+
+    unsigned int rows() const {
+        return _rows;
+    }
+
+    uint16_t count(const unsigned int column, const unsigned int row) const {
+        return _counts[row * _columns + column];
+    }
+
+    // Finds the 4-connected region of blocks (each with at least block_threshold changed pixels) having the most changed pixels.
+    Region largest_region(const uint16_t block_threshold) const {
+        Region largest = { 0, 0 };
+        _visited.assign(_counts.size(), false);
+
+        for (size_t start = 0; start < _counts.size(); start++) {
+            if (_visited[start] || _counts[start] < block_threshold) {
+                continue;
+            }
+
+            Region region = { 0, 0 };
+            _stack.clear();
+            _stack.push_back(start);
+            _visited[start] = true;
+
+            while (!_stack.empty()) {
+                const size_t index = _stack.back();
+                _stack.pop_back();
+                region.blocks++;
+                region.pixels += _counts[index];
+
+                const unsigned int column = index % _columns;
+                const size_t neighbors[4] = {
+                    (column > 0) ? index - 1 : SIZE_MAX,
+                    (column < _columns - 1) ? index + 1 : SIZE_MAX,
+                    (index >= _columns) ? index - _columns : SIZE_MAX,
+                    (index + _columns < _counts.size()) ? index + _columns : SIZE_MAX,
+                };
+
+                for (const size_t neighbor : neighbors) {
+                    if (neighbor != SIZE_MAX && !_visited[neighbor] && _counts[neighbor] >= block_threshold) {
+                        _visited[neighbor] = true;
+                        _stack.push_back(neighbor);
+                    }
+                }
+            }
+
+            if (region.pixels > largest.pixels) {
+                largest = region;
+            }
+        }
+
+        return largest;
+    }
+
+    // One character per block: '.' for untouched, '+' for some change, '#' for at least block_threshold.
+    std::string description(const uint16_t block_threshold) const {
+        std::string description = "";
+
+        for (unsigned int row = 0; row < _rows; row++) {
+            for (unsigned int column = 0; column < _columns; column++) {
+                const uint16_t value = count(column, row);
+                description += (value >= block_threshold) ? '#' : (value > 0) ? '+' : '.';
+            }
+
+            description += '\n';
+        }
+
+        return description;
+    }
+
+    // Renders the grid as an 8-bit grayscale image, one pixel per block, with brightness proportional to the fraction of the block that changed.
+    std::vector<uint8_t> image() const {
+        std::vector<uint8_t> image(_counts.size());
+
+        for (size_t i = 0; i < _counts.size(); i++) {
+            image[i] = (uint8_t)std::min(255u, (unsigned int)_counts[i] * 255 / (block_size * block_size));
+        }
+
+        return image;
+    }
+
+private:
+    unsigned int _columns;
+    unsigned int _rows;
+    std::vector<uint16_t> _counts;
+
+    // Scratch space for largest_region(), kept around to avoid reallocating every frame.
+    mutable std::vector<bool> _visited;
+    mutable std::vector<size_t> _stack;
+};
+
 [[maybe_unused]] static void move_file(const std::string source, const std::string destination) {
     const int rv = rename(source.c_str(), destination.c_str());
 
@@ -181,6 +438,45 @@ private:
     }
 }
 
+// Creates a listening Unix domain socket at path, replacing any stale socket file.  Returns -1 on failure.
+[[maybe_unused]] static int listen_unix_socket(const std::string path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof (address.sun_path)) {
+        return -1;
+    }
+
+    strncpy(address.sun_path, path.c_str(), sizeof (address.sun_path) - 1);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    unlink(path.c_str());
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof (address)) != 0 || listen(fd, 8) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+[[maybe_unused]] static std::string datestamp_string(const time_t t) {
+    char string_buffer[1024];
+    strftime(string_buffer, sizeof (string_buffer), "%Y-%m-%d", localtime(&t));
+    return std::string(string_buffer);
+}
+
+[[maybe_unused]] static std::string timestamp_string(const time_t t) {
+    char string_buffer[1024];
+    strftime(string_buffer, sizeof (string_buffer), "%Y-%m-%dT%H:%M:%S%z", localtime(&t));
+    return std::string(string_buffer);
+}
+
 static std::string timebase_str(const AVRational timebase) {
     return "{" + std::to_string(timebase.num) + " / " + std::to_string(timebase.den) + "}";
 }
@@ -0,0 +1,114 @@
+//
+//  yuv.h
+//  sophie
+//
+//  Created by Matt Jacobson on 10/18/26.
+//
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+}
+
+#include "log.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef YUV_H
+#define YUV_H
+
+enum class ChromaLayout {
+    planar,         // U and V in data[1] and data[2]
+    interleaved_uv, // UVUV... in data[1]
+    interleaved_vu, // VUVU... in data[1]
+};
+
+// Compile-time description of a 4:2:0 pixel format, so per-pixel code can be specialized for it and read the planes in place.
+// Samples are `depth` bits wide, stored in a `Sample` shifted left by `shift` (P010 keeps its 10 bits at the top of each 16-bit word).
+template <typename SampleType, int depth, int shift, ChromaLayout layout>
+struct YUV420Format {
+    typedef SampleType Sample;
+    static constexpr int bit_depth = depth;
+    static constexpr ChromaLayout chroma_layout = layout;
+
+    static const Sample *row(const AVFrame *const frame, const int plane, const int y) {
+        return (const Sample *)(frame->data[plane] + y * frame->linesize[plane]);
+    }
+
+    static Sample *mutable_row(AVFrame *const frame, const int plane, const int y) {
+        return (Sample *)(frame->data[plane] + y * frame->linesize[plane]);
+    }
+
+    // Scales a sample down to 8 bits, so thresholds mean the same thing regardless of format.
+    static uint8_t to_8bit(const Sample sample) {
+        return (uint8_t)((sample >> shift) >> (depth - 8));
+    }
+
+    static Sample from_8bit(const uint8_t value) {
+        return (Sample)(((unsigned int)value << (depth - 8)) << shift);
+    }
+};
+
+typedef YUV420Format<uint8_t, 8, 0, ChromaLayout::planar> YUV420P8;
+typedef YUV420Format<uint8_t, 8, 0, ChromaLayout::interleaved_uv> NV12Format;
+typedef YUV420Format<uint8_t, 8, 0, ChromaLayout::interleaved_vu> NV21Format;
+typedef YUV420Format<uint16_t, 10, 0, ChromaLayout::planar> YUV420P10;
+typedef YUV420Format<uint16_t, 10, 6, ChromaLayout::interleaved_uv> P010Format;
+
+// Calls `function` with an instance of the YUV420Format matching `format`, and returns what it returns.
+template <typename Function>
+static auto dispatch_yuv420(const int format, Function function) {
+    switch (format) {
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:
+            return function(YUV420P8());
+        case AV_PIX_FMT_NV12:
+            return function(NV12Format());
+        case AV_PIX_FMT_NV21:
+            return function(NV21Format());
+        case AV_PIX_FMT_YUV420P10:
+            return function(YUV420P10());
+        case AV_PIX_FMT_P010:
+            return function(P010Format());
+        default:
+            LOG(LOG_ERROR, "unsupported pixel format: %s", av_get_pix_fmt_name((enum AVPixelFormat)format));
+            abort();
+    }
+}
+
+// Maps the frame's colorspace tag to swscale's coefficient tables.
+static inline int sws_colorspace_for_frame(const AVFrame *const frame) {
+    switch (frame->colorspace) {
+        case AVCOL_SPC_BT709:
+            return SWS_CS_ITU709;
+        case AVCOL_SPC_FCC:
+            return SWS_CS_FCC;
+        case AVCOL_SPC_BT470BG:
+            return SWS_CS_ITU601;
+        case AVCOL_SPC_SMPTE170M:
+            return SWS_CS_SMPTE170M;
+        case AVCOL_SPC_SMPTE240M:
+            return SWS_CS_SMPTE240M;
+        case AVCOL_SPC_BT2020_NCL:
+        case AVCOL_SPC_BT2020_CL:
+            return SWS_CS_BT2020;
+        default:
+            // Untagged.  Our cameras are HD, so BT.709 is the best guess.
+            return SWS_CS_ITU709;
+    }
+}
+
+// YUVJ420P is just full-range YUV420P; swscale complains about the former, so convert from the latter and say so in the range (see set_sws_colorspace_for_frame()).
+static inline enum AVPixelFormat sws_format_for_frame(const AVFrame *const frame) {
+    return (frame->format == AV_PIX_FMT_YUVJ420P) ? AV_PIX_FMT_YUV420P : (enum AVPixelFormat)frame->format;
+}
+
+// Sets up a conversion from the frame to RGB according to the frame's tags.
+static inline void set_sws_colorspace_for_frame(struct SwsContext *const ctx, const AVFrame *const frame) {
+    const bool full_range = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P;
+    sws_setColorspaceDetails(ctx, sws_getCoefficients(sws_colorspace_for_frame(frame)), full_range ? 1 : 0, sws_getCoefficients(SWS_CS_DEFAULT), 0, 0, 1 << 16, 1 << 16);
+}
+
+#endif /* YUV_H */